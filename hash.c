@@ -1,59 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
 #include "hash.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 /* --- initial size for hash table slots and arena chunks (in bytes) --- */
 #define HM_INITIAL_CAPACITY 1u<<9   // 512 default capacity, doubles
-#define HM_ARENA_CHUNK_SIZE 1u<<12  // 4096 bytes par chunk
+#define HM_ARENA_CHUNK_SIZE 1u<<12  // 4096 bytes for the first chunk, doubles
+#define HM_ARENA_CHUNK_MAX  1u<<20  // up to 1 MiB per chunk
+
+/* --- Counters ---
+ *
+ * Built with -DHM_STATS_COUNTERS the lookup and insert paths count what they
+ * do into hm->counters, for hm_stats. Without it they compile to nothing.
+ * Lookups run under a shared lock or none at all (hm_sharded_get, readers
+ * of an HM_CONCURRENT map), so the counts are relaxed atomic adds. */
+#ifdef HM_STATS_COUNTERS
+#define HM_COUNT(c, field, n) ((void)__atomic_fetch_add(&(c)->field, (uint64_t)(n), __ATOMIC_RELAXED))
+#define HM_COUNTED(c, field)  __atomic_load_n(&(c)->field, __ATOMIC_RELAXED)
+#else
+#define HM_COUNT(c, field, n) ((void)0)
+#define HM_COUNTED(c, field)  ((c)->field)
+#endif
+
+/* --- Allocation ---
+ *
+ * Everything a map allocates goes through its allocator: the one it was
+ * given, or else whichever was the default the first time it allocated
+ * (then it sticks, so a map never frees into a different allocator than it
+ * allocated from). Sizes are passed along to free and realloc for
+ * allocators that want them, slabs and bump allocators mostly.
+ * */
+static void *_libc_alloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *_libc_realloc(void *ctx, void *p, size_t old_size, size_t size)
+{
+    (void)ctx; (void)old_size;
+    return realloc(p, size);
+}
+
+static void _libc_free(void *ctx, void *p, size_t size)
+{
+    (void)ctx; (void)size;
+    free(p);
+}
+
+static const hm_allocator _hm_libc = { _libc_alloc, _libc_realloc, _libc_free, NULL };
+static const hm_allocator *_hm_default_allocator = &_hm_libc;
+
+void hm_set_default_allocator(const hm_allocator *a)
+{
+    _hm_default_allocator = a ? a : &_hm_libc;
+}
+
+/* The allocator of a map (or anything with an allocator field) */
+#define _hm_alloc_of(m) ((m)->allocator ? (m)->allocator : ((m)->allocator = _hm_default_allocator))
+
+static inline void *_hm_malloc(const hm_allocator *a, size_t size)
+{
+    return a->alloc(a->ctx, size);
+}
+
+/* Zeroed. From libc that is calloc, which gets big blocks as fresh zero
+ * pages instead of writing them */
+static void *_hm_calloc(const hm_allocator *a, size_t size)
+{
+    if (a == &_hm_libc)
+        return calloc(1, size);
+    void *p = a->alloc(a->ctx, size);
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+static inline void *_hm_realloc(const hm_allocator *a, void *p, size_t old_size, size_t size)
+{
+    return a->realloc(a->ctx, p, old_size, size);
+}
+
+/* For structs that want more than malloc's alignment (cache line padded
+ * ones): allocate align - 1 bytes more and round the pointer up */
+#define _hm_align_up(p, align) ((void *)(((uintptr_t)(p) + (align) - 1) & ~(uintptr_t)((align) - 1)))
+
+/* a may be NULL when p is, for maps that never allocated anything */
+static inline void _hm_free(const hm_allocator *a, void *p, size_t size)
+{
+    if (p) a->free(a->ctx, p, size);
+}
 
 /* --- Arena Implementation and definitions ---
  *
  * Using a singly linked list for the chunks
  * Arena lifetime is bound to hashmap lifetime
+ *
+ * Allocations are rounded up to 8 bytes. Freed blocks (removed keys) go on a
+ * free list per size class, 8 bytes apart up to HM_ARENA_CLASSES * 8, and
+ * are handed out again before bumping. The block itself holds the link, so
+ * the lists cost nothing. Blocks bigger than the largest class are only given
+ * back by hm_compact.
+ *
+ * Every new chunk is twice the size of the one before, up to max_cap, so a
+ * bulk load takes a handful of chunks instead of one malloc per 4 KiB. The
+ * chunk header and its memory come from the same allocation.
  * */
+#define HM_ARENA_CLASSES 32
+
 typedef struct arena_chunk {
-    unsigned char *base;
     size_t cap;
     size_t used;
     struct arena_chunk *next;
+    _Alignas(8) unsigned char base[];
 } hm_arena_chunk;
 
 typedef struct {
     hm_arena_chunk *head;
-    size_t default_cap;
+    hm_arena_chunk *spare;          // emptied by _arena_rewind, used before new ones
+    size_t default_cap;             // size of the next chunk
+    size_t max_cap;                 // chunks stop growing here
+    void *free[HM_ARENA_CLASSES];   // size class i holds blocks of i*8 bytes
+    const hm_allocator *alloc;      // the map's
 } hm_arena;
 
-static void _arena_init(hashmap *hm) {
-    hm_arena *a = malloc(sizeof *hm->arena);
-    a->head = NULL;
-    a->default_cap = HM_ARENA_CHUNK_SIZE;
+static int _arena_init(hashmap *hm, size_t chunk, size_t chunk_max) {
+    hm_arena *a = _hm_calloc(_hm_alloc_of(hm), sizeof *a);
+    if (!a) return -1;
+    a->alloc = hm->allocator;
+    a->default_cap = chunk ? chunk : HM_ARENA_CHUNK_SIZE;
+    a->max_cap = chunk_max ? chunk_max : HM_ARENA_CHUNK_MAX;
+    if (a->max_cap < a->default_cap)
+        a->max_cap = a->default_cap;
     hm->arena = a;
+    return 0;
 }
 
+#define _arena_round(sz) (((sz) + 7) & ~((size_t)7))
+
 static void *_arena_alloc(hm_arena *a, size_t sz)
 {
+    sz = _arena_round(sz);
+
+    /* reuse a freed block of the same size class */
+    size_t cls = sz / 8;
+    if (cls < HM_ARENA_CLASSES && a->free[cls]) {
+        void *p = a->free[cls];
+        memcpy(&a->free[cls], p, sizeof(void *));
+        return p;
+    }
+
     hm_arena_chunk *c = a->head;
 
     if (c) {
-        /* align allocation start (must be done before capacity check) */
-        size_t off = (c->used + 7) & ~((size_t)7);
-
-        /* ensure aligned allocation fits in chunk */
-        if (off + sz <= c->cap) {
-            c->used = off + sz;
-            return c->base + off;
+        /* sizes are rounded, so used stays aligned */
+        if (c->used + sz <= c->cap) {
+            void *p = c->base + c->used;
+            c->used += sz;
+            return p;
         }
     }
 
-    /* allocate new chunk if no space */
+    /* a spare chunk big enough, before asking for a new one */
+    for (hm_arena_chunk **s = &a->spare; *s; s = &(*s)->next) {
+        if ((*s)->cap < sz) continue;
+        hm_arena_chunk *n = *s;
+        *s = n->next;
+        n->used = sz;
+        n->next = a->head;
+        a->head = n;
+        return n->base;
+    }
+
+    /* allocate new chunk if no space, and grow the next one */
     size_t cap = a->default_cap > sz ? a->default_cap : sz;
 
-    hm_arena_chunk *n = malloc(sizeof *n);
+    hm_arena_chunk *n = _hm_malloc(a->alloc, sizeof *n + cap);
     if (!n) return NULL;
 
-    n->base = malloc(cap);
-    if (!n->base) {
-        free(n);
-        return NULL;
-    }
+    if (a->default_cap < a->max_cap)
+        a->default_cap = a->default_cap * 2 < a->max_cap ? a->default_cap * 2 : a->max_cap;
 
     n->cap  = cap;
     n->used = sz;        // first allocation, already aligned
@@ -63,249 +196,3307 @@ static void *_arena_alloc(hm_arena *a, size_t sz)
     return n->base;
 }
 
+/* Gives a block of sz bytes back, for _arena_alloc to hand out again */
+static void _arena_release(hm_arena *a, void *p, size_t sz)
+{
+    size_t cls = _arena_round(sz) / 8;
+    if (cls >= HM_ARENA_CLASSES)
+        return;
+    memcpy(p, &a->free[cls], sizeof(void *));
+    a->free[cls] = p;
+}
+
+/* Bytes held in chunks, used or not */
+static size_t _arena_size(const hm_arena *a)
+{
+    size_t total = 0;
+    for (const hm_arena_chunk *c = a->head; c; c = c->next)
+        total += c->cap;
+    for (const hm_arena_chunk *c = a->spare; c; c = c->next)
+        total += c->cap;
+    return total;
+}
+
+/* Forgets every block, keeping the chunks to fill again */
+static void _arena_rewind(hm_arena *a)
+{
+    while (a->head) {
+        hm_arena_chunk *c = a->head;
+        a->head = c->next;
+        c->used = 0;
+        c->next = a->spare;
+        a->spare = c;
+    }
+    memset(a->free, 0, sizeof a->free);
+}
+
 static void _arena_free(hm_arena *a)
 {
-    hm_arena_chunk *s = a->head;
-    while (s) {
-        hm_arena_chunk *next = s->next;
-        free(s->base);
-        free(s);
-        s = next;
+    for (int list = 0; list < 2; list++) {
+        hm_arena_chunk *s = list ? a->spare : a->head;
+        while (s) {
+            hm_arena_chunk *next = s->next;
+            _hm_free(a->alloc, s, sizeof *s + s->cap);
+            s = next;
+        }
     }
     a->head = NULL;
+    a->spare = NULL;
+    memset(a->free, 0, sizeof a->free);
 }
-/* my own utility functions and string builder  */
-static char *_str_arena(hm_arena *a, const char *s)
+/* my own utility functions and string builder
+ *
+ * Keys carry their length, so the copy is one memcpy and the NUL is only
+ * added for the convenience of anyone reading the key back as a C string.
+ * */
+static char *_str_arena(hm_arena *a, const char *s, size_t len)
 {
-    size_t n=0, i=0;
-    while(s[n++]!=0); // manual strlen
-
-    char *p = _arena_alloc(a, n);
+    char *p = _arena_alloc(a, len + 1);
     if (p) {
-        while((p[i]=s[i])!='\0') i++; // manual memcpy
+        memcpy(p, s, len);
+        p[len] = '\0';
     }
     return p;
 }
 
-/* assume null-terminated - safe because not exposed to users */
-static int s_cmp(const char *s1, const char *s2) {
-    size_t n = 0;
-    while (s1[n] && s2[n] && s1[n] == s2[n])
-        n++;
-    return (unsigned char)s1[n] - (unsigned char)s2[n];
-}
-#define match(s, n) s_cmp(s, n)==0
-
 /**********/
 
 #define FNV_OFFSET 0xcbf29ce484222325
 #define FNV_PRIME  0x100000001b3
 
-/* This returns a 64-bit (size_t) fnv-1a hash for a given key,
- * assumed to be null-terminated
+/* This returns a 64-bit fnv-1a hash for a given key of len bytes. The seed
+ * is folded into the offset basis. Kept for comparison and as an option, it
+ * is no longer the default: one serial multiply per byte is slow on the
+ * 40-80 byte keys we see.
  *
  * https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
  * */
-static size_t hash_key(const char* key)
+uint64_t hm_hash_fnv1a(const void *key, size_t len, uint64_t seed)
 {
-    size_t hash = FNV_OFFSET;
-    for (const char* s = key; *s; s++){
-        hash ^= (size_t)(unsigned char)(*s);
+    const unsigned char *p = key;
+    uint64_t hash = FNV_OFFSET ^ seed;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (uint64_t)p[i];
         hash *= FNV_PRIME;
     }
     return hash;
 }
 
-/* Linear probing needs to skip empty slots that WERE taken, but also we need
- * to be able to fill in removed spots - therefore we need a marker!
- * Create an empty string and declare TOMBSTONE to be a pointer to this string */
-static char deleted[] = " ";
-#define TOMBSTONE ((char*)deleted)
+/* --- Default hash: wyhash (final 4), https://github.com/wangyi-fudan/wyhash
+ *
+ * Reads the key 8 or 16 bytes at a time and mixes with a 64x64->128 bit
+ * multiply folded back to 64 bits, which modern cores do in a few cycles.
+ * Short keys (<= 16 bytes) are two overlapping loads and two multiplies.
+ * */
+#define WY_P0 0x2d358dccaa6c78a5ull
+#define WY_P1 0x8bb84b93962eacc9ull
+#define WY_P2 0x4b33a62ed433d4a3ull
+#define WY_P3 0x4d5a2da51de1aa47ull
+
+/* a*b as 128 bits, low half back in a, high half in b */
+static inline void _wy_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t _wy_mix(uint64_t a, uint64_t b)
+{
+    _wy_mum(&a, &b);
+    return a ^ b;
+}
 
-/* Checks if the map contains a map to key - will return on first empty spot
- * that is not same hash or tombstone */
-int hm_contains_key(hashmap *hm, const char *key)
+/* unaligned native-endian reads, memcpy compiles to a single load */
+static inline uint64_t _wy_r8(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t _wy_r4(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t _wy_r3(const uint8_t *p, size_t k)
 {
-    if (hm->capacity == 0) return 0;
-    /* cap-1 give a bitmask since we are powers of 2; '&' is basicly free,
-     * while the modulos operation would be same answer, but more expensive
-     * */
-    size_t hash = hash_key(key);
-    size_t hash_index = hash & (hm->capacity-1);
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
 
-    hm_entry *e = &hm->items[hash_index];
+uint64_t hm_hash_wyhash(const void *key, size_t len, uint64_t seed)
+{
+    const uint8_t *p = key;
+    uint64_t a, b;
 
-    while (e->key) {
-        if (e->key != TOMBSTONE && e->hash == hash)
-                if(match(e->key, key))
-                    return 1;
-        hash_index = (hash_index + 1) & (hm->capacity-1);
-        e = &hm->items[hash_index];
+    seed ^= _wy_mix(seed ^ WY_P0, WY_P1);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (_wy_r4(p) << 32) | _wy_r4(p + ((len >> 3) << 2));
+            b = (_wy_r4(p + len - 4) << 32) | _wy_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = _wy_r3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = _wy_mix(_wy_r8(p) ^ WY_P1, _wy_r8(p + 8) ^ seed);
+                see1 = _wy_mix(_wy_r8(p + 16) ^ WY_P2, _wy_r8(p + 24) ^ see1);
+                see2 = _wy_mix(_wy_r8(p + 32) ^ WY_P3, _wy_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = _wy_mix(_wy_r8(p) ^ WY_P1, _wy_r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _wy_r8(p + i - 16);
+        b = _wy_r8(p + i - 8);
     }
-    return 0;
+    a ^= WY_P1;
+    b ^= seed;
+    _wy_mum(&a, &b);
+    return _wy_mix(a ^ WY_P0 ^ len, b ^ WY_P1);
 }
 
-/* Checks if the map contains one or more items->keys mapped to value. */
-int hm_contains_value(hashmap *hm, uintptr_t value)
+/* --- Per-map seeds ---
+ *
+ * A map with seed 0 picks a random one the first time it hashes anything, so
+ * nobody can precompute a set of keys that all land in the same group. The
+ * randomness comes from /dev/urandom once per process (with the clock and an
+ * address as fallback), mixed with a counter so every map gets its own seed.
+ * */
+static uint64_t _hm_random_seed(const void *salt)
 {
-    for (size_t i = 0; i < hm->capacity; i++) {
-        if (hm->items[i].key == NULL) continue;
-        if (hm->items[i].key == TOMBSTONE) continue;
-        if (hm->items[i].value == value) return 1;
+    static _Atomic uint64_t secret;
+    static _Atomic uint64_t counter;
+
+    uint64_t s = atomic_load_explicit(&secret, memory_order_relaxed);
+    if (!s) {
+        FILE *f = fopen("/dev/urandom", "rb");
+        if (!f || fread(&s, sizeof s, 1, f) != 1)
+            s = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&secret;
+        if (f) fclose(f);
+        s |= 1;
+        atomic_store_explicit(&secret, s, memory_order_relaxed);
     }
-    return 0;
+
+    uint64_t n = atomic_fetch_add_explicit(&counter, 1, memory_order_relaxed);
+    uint64_t seed = _wy_mix(s ^ n, (uint64_t)(uintptr_t)salt ^ WY_P2);
+    return seed ? seed : WY_P3;
 }
 
+/* Hash of len bytes of key with the map's hasher and seed */
+static inline size_t hash_key(hashmap *hm, const char *key, size_t len)
+{
+    if (!hm->seed)
+        hm->seed = _hm_random_seed(hm);
+    if (hm->hasher)
+        return (size_t)hm->hasher(key, len, hm->seed);
+    return (size_t)hm_hash_wyhash(key, len, hm->seed);
+}
 
-/* Internal helper to set an entry */
-static int _hm_set_entry(hashmap *hm, const char *key, uintptr_t value)
+/* A key as the probe loops see it: measured and hashed once per call, and
+ * when short enough, zero padded into two words so it compares against an
+ * inline entry key with two integer compares instead of a byte loop. */
+typedef struct {
+    const char *p;
+    size_t len;
+    size_t hash;
+    uint64_t w[2];
+    int inl;            // short keys are inline, 0 in an HM_INTERN map
+} hm_key;
+
+static inline hm_key _hm_key_in(const char *key, size_t len, size_t hash, int inl)
 {
-    size_t hash = hash_key(key);
-    size_t idx = hash & (hm->capacity - 1);
+    hm_key k = { .p = key, .len = len, .hash = hash, .inl = inl };
+    if (inl && len <= HM_INLINE_KEY)
+        memcpy(k.w, key, len);
+    return k;
+}
 
-    hm_entry *items = hm->items;
-    size_t tombstone_idx = (size_t)-1;
+#define _hm_key(key, len, hash) _hm_key_in(key, len, hash, 1)
+#define _hm_map_key(hm, key, len, hash) _hm_key_in(key, len, hash, !((hm)->flags & HM_INTERN))
 
-    for (;;) {
-        hm_entry *e = &items[idx];
+/* --- Interned keys (HM_INTERN) ---
+ *
+ * Every key of an HM_INTERN map is copied to the arena, short ones too, with
+ * its hash and length in front, so the copy is a canonical pointer that
+ * stays put for as long as the key is in the map: rebuilds move entries,
+ * not keys, and such a map is never compacted. Given that pointer, the map
+ * reads the hash instead of computing it, and compares keys by address
+ * before it falls back to their bytes.
+ * */
+typedef struct {
+    size_t hash;
+    size_t len;
+} hm_intern_head;
 
-        if (e->key == NULL) {
-            // empty slot -> insert (but prefer a tombstone if we saw one)
-            if (tombstone_idx != (size_t)-1)
-                e = &items[tombstone_idx];
+#define _hm_inline(hm, len) ((len) <= HM_INLINE_KEY && !((hm)->flags & HM_INTERN))
 
-            e->key   = _str_arena(hm->arena, key);
-            e->value = value;
-            e->hash  = hash;
-            hm->count++;
-            return 0;   // new insert
+/* What goes before an arena key, and the bytes it takes with it */
+#define _hm_key_head(hm)       (((hm)->flags & HM_INTERN) ? sizeof(hm_intern_head) : 0)
+#define _hm_key_bytes(hm, len) (_hm_key_head(hm) + (len) + 1)
+
+static char *_str_intern(hm_arena *a, const hm_key *k)
+{
+    hm_intern_head *h = _arena_alloc(a, sizeof *h + k->len + 1);
+    if (!h) return NULL;
+    *h = (hm_intern_head){ k->hash, k->len };
+    char *p = (char *)(h + 1);
+    memcpy(p, k->p, k->len);
+    p[k->len] = '\0';
+    return p;
+}
+
+/* A long key of an entry. In a mapped snapshot entries hold an offset into
+ * the key blob (keys) instead of a pointer, see hm_open_mmap. */
+static inline const char *_long_key(const hm_entry *e, const char *keys)
+{
+    return keys ? keys + (uintptr_t)e->key : e->key;
+}
+
+/* Same key? The length check rules out most candidates on its own */
+static inline int _key_eq(const hm_entry *e, const hm_key *k, const char *keys)
+{
+    if (e->len != k->len) return 0;
+    if (k->inl && k->len <= HM_INLINE_KEY) {
+        uint64_t w[2];
+        memcpy(w, e->ikey, sizeof w);
+        return w[0] == k->w[0] && w[1] == k->w[1];
+    }
+    const char *p = _long_key(e, keys);
+    return p == k->p || memcmp(p, k->p, k->len) == 0;
+}
+
+/* Stores the key in the entry, inline if it fits, else copied to arena a */
+static inline int _key_store_in(hm_arena *a, hm_entry *e, const hm_key *k)
+{
+    e->len = k->len;
+    if (k->inl && k->len <= HM_INLINE_KEY) {
+        memcpy(e->ikey, k->w, sizeof k->w);
+        return 0;
+    }
+    e->key = k->inl ? _str_arena(a, k->p, k->len) : _str_intern(a, k);
+    return e->key ? 0 : -1;
+}
+
+#define _key_store(hm, e, k) _key_store_in((hm)->arena, e, k)
+
+/* --- Control bytes and group probing ---
+ *
+ * Next to the items array sits one control byte per slot. The probe loops only
+ * look at these bytes, 16 at a time, and touch an hm_entry only when its byte
+ * says it could be the key we are after. That way one compare rules out a whole
+ * group, instead of loading a cache line for every 2-3 entries.
+ *
+ *     0x00           EMPTY, never used (so a calloc'd table is all empty)
+ *     0x01           DELETED, the tombstone: skipped by lookups, reused by puts
+ *     0x80 | h2      FULL, where h2 is the low 7 bits of the hash
+ *
+ * The rest of the hash (h1) picks the home slot. Groups are aligned runs of 16
+ * slots and we probe linearly, group by group, until a group with an EMPTY.
+ * */
+#define HM_CTRL_EMPTY   0x00
+#define HM_CTRL_DELETED 0x01
+#define HM_GROUP_WIDTH  16
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)(0x80 | ((hash) & 0x7f)))
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/* bit i set if ctrl byte i in the group equals b */
+static inline unsigned _group_match(const uint8_t *g, uint8_t b)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)g);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)b)));
+}
+
+/* bit i set if slot i is FULL - the high bit of the ctrl byte */
+static inline unsigned _group_match_full(const uint8_t *g)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)g);
+    return (unsigned)_mm_movemask_epi8(v);
+}
+#else
+/* scalar fallback, same answers one byte at a time */
+static inline unsigned _group_match(const uint8_t *g, uint8_t b)
+{
+    unsigned m = 0;
+    for (unsigned i = 0; i < HM_GROUP_WIDTH; i++)
+        m |= (unsigned)(g[i] == b) << i;
+    return m;
+}
+
+static inline unsigned _group_match_full(const uint8_t *g)
+{
+    unsigned m = 0;
+    for (unsigned i = 0; i < HM_GROUP_WIDTH; i++)
+        m |= (unsigned)(g[i] >> 7) << i;
+    return m;
+}
+#endif
+
+/* bit i set if slot i is EMPTY or DELETED, i.e. can take an insert */
+#define _group_match_free(g) (~_group_match_full(g) & 0xffffu)
+#define _group_match_empty(g) _group_match(g, HM_CTRL_EMPTY)
+
+/* index of lowest set bit, mask must be non-zero */
+#define _lowest(m) ((unsigned)__builtin_ctz(m))
+
+/* A table as the probe loops see it. A map has one, or two while an
+ * incremental resize is moving entries from the old one to the new one. */
+typedef struct {
+    hm_entry *items;
+    uint8_t *ctrl;
+    size_t capacity;
+    size_t max_probe;   // no key is more than this many groups from home
+    const char *keys;   // mapped snapshot key blob, NULL = long keys are pointers
+    hm_counters *counters;  // the map's, see HM_COUNT
+    uint32_t *index;    // HM_ORDERED: slot -> entry in items, NULL = slot i is items[i]
+} hm_table;
+
+#define _hm_table(hm)     ((hm_table){ (hm)->items, (hm)->ctrl, (hm)->capacity, (hm)->max_probe, (hm)->mapped_keys, &(hm)->counters, (hm)->index })
+#define _hm_old_table(hm) ((hm_table){ (hm)->old_items, (hm)->old_ctrl, (hm)->old_capacity, (hm)->old_max_probe, NULL, &(hm)->counters, NULL })
+
+/* The entry in slot i of t */
+#define _tbl_entry(t, i) ((t)->index ? &(t)->items[(t)->index[i]] : &(t)->items[i])
+
+/* First group to probe for a hash, and the step to the next one. The table
+ * is never smaller than a group so the masks stay simple. */
+#define _home_group(t, hash) (H1(hash) & ((t)->capacity - 1) & ~(size_t)(HM_GROUP_WIDTH - 1))
+#define _next_group(t, g)    (((g) + HM_GROUP_WIDTH) & ((t)->capacity - 1))
+
+/* How many groups past its home group an entry in group g is */
+#define _group_dist(t, g, hash) ((((g) - _home_group(t, hash)) & ((t)->capacity - 1)) / HM_GROUP_WIDTH)
+
+#define _hm_table_bytes(cap) ((cap) * (sizeof(hm_entry) + 1))
+#define _hm_index_bytes(cap) ((cap) * (sizeof(uint32_t) + 1))
+
+/* Allocates the items array with its control bytes in the same block, right
+ * after the entries. Freeing items frees both. An HM_ORDERED map's table is
+ * the index instead, with the control bytes after it, and its entries stay
+ * where they are. Unless zeroed the control bytes are left for the caller
+ * to set, see _hm_rehash. */
+static int _hm_alloc_table(hashmap *hm, hm_table *t, size_t cap, int zeroed)
+{
+    t->capacity = cap;
+    t->keys = NULL;
+    t->counters = &hm->counters;
+    if (hm->flags & HM_ORDERED) {
+        uint32_t *index = _hm_calloc(_hm_alloc_of(hm), _hm_index_bytes(cap));
+        if (!index) return -1;
+        t->items = hm->items;
+        t->index = index;
+        t->ctrl  = (uint8_t *)(index + cap);
+        return 0;
+    }
+    hm_entry *block = zeroed ? _hm_calloc(_hm_alloc_of(hm), _hm_table_bytes(cap))
+                             : _hm_malloc(_hm_alloc_of(hm), _hm_table_bytes(cap));
+    if (!block) return -1;
+    t->items = block;
+    t->index = NULL;
+    t->ctrl  = (uint8_t *)(block + cap);
+    return 0;
+}
+
+/* Returns the slot holding key, or (size_t)-1 when not found. Stops at the
+ * first group that has an EMPTY, or once it is further from home than any
+ * key in the table, whichever comes first. */
+static size_t _tbl_find(const hm_table *t, const hm_key *k)
+{
+    if (t->capacity == 0) return (size_t)-1;
+
+    uint8_t h2 = H2(k->hash);
+    size_t g = _home_group(t, k->hash);
+    HM_COUNT(t->counters, finds, 1);
+
+    for (size_t n = t->max_probe + 1; n; n--) {
+        const uint8_t *ctrl = t->ctrl + g;
+        HM_COUNT(t->counters, groups, 1);
+
+        for (unsigned m = _group_match(ctrl, h2); m; m &= m - 1) {
+            const hm_entry *e = _tbl_entry(t, g + _lowest(m));
+            if (e->hash == k->hash && _key_eq(e, k, t->keys))
+                return g + _lowest(m);
+            HM_COUNT(t->counters, tag_misses, 1);
         }
+        if (_group_match_empty(ctrl))
+            break;
+        g = _next_group(t, g);
+    }
+    return (size_t)-1;
+}
+
+/* --- Robin Hood placement ---
+ *
+ * Places e, whose key is known not to be in t, in the first group with a free
+ * slot. On the way, in every full group it passes, the entry closest to its
+ * own home gives up its slot if e is further from home than that, and is
+ * placed further on instead ("take from the rich"). That evens out how far
+ * entries sit from home, so the longest distance, max_probe, stays small even
+ * at a high load, and a miss gives up after max_probe groups instead of
+ * walking the run of full groups up to the next EMPTY.
+ *
+ * Only the place an entry ends up changes, lookups do not depend on it, so
+ * tombstones and the other ways of filling a table are all still fine.
+ *
+ * Returns the slot e itself went to, the entries it pushed on go elsewhere.
+ *
+ * _tbl_place_until stops when the probe gets to group end instead, leaving
+ * the entry it was about to carry further in *e and returning (size_t)-1.
+ * hm_build uses it to keep every thread inside its own range of the table.
+ * */
+static inline size_t _tbl_place_until(hm_table *t, hm_entry *ep, size_t end,
+                                      size_t *max_probe, size_t *tombstones)
+{
+    hm_entry e = *ep;
+    size_t g = _home_group(t, e.hash);
+    size_t dist = 0;
+    size_t slot = (size_t)-1;
 
-        if (e->key == TOMBSTONE) {
-            // record first tombstone, and keep probing
-            if (tombstone_idx == (size_t)-1)
-                tombstone_idx = idx;
+    for (;;) {
+        unsigned fm = _group_match_free(t->ctrl + g);
+        if (fm) {
+            size_t idx = g + _lowest(fm);
+            if (t->ctrl[idx] == HM_CTRL_DELETED)
+                (*tombstones)--;
+            t->items[idx] = e;
+            t->ctrl[idx]  = H2(e.hash);
+            if (dist > *max_probe) *max_probe = dist;
+            return slot != (size_t)-1 ? slot : idx;
         }
-        else if (e->hash == hash && match(e->key, key)) {
-            // found existing key -> overwrite
-            e->value = value;
-            return 1;  // overwrite
+
+        /* full group: find the entry with the shortest distance */
+        size_t rich = (size_t)-1, rich_dist = dist;
+        for (size_t i = g; i < g + HM_GROUP_WIDTH; i++) {
+            size_t d = _group_dist(t, g, t->items[i].hash);
+            if (d < rich_dist) {
+                rich = i;
+                rich_dist = d;
+            }
+        }
+        if (rich != (size_t)-1) {
+            if (slot == (size_t)-1)
+                slot = rich;
+            hm_entry evicted = t->items[rich];
+            t->items[rich] = e;
+            t->ctrl[rich]  = H2(e.hash);
+            if (dist > *max_probe) *max_probe = dist;
+            e = evicted;
+            dist = rich_dist;
         }
 
-        idx = (idx + 1) & (hm->capacity - 1);
+        g = _next_group(t, g);
+        dist++;
+        if (g == end) {
+            *ep = e;
+            return (size_t)-1;
+        }
     }
 }
 
-/* Reindexing when resizing */
-static int _hm_resize(hashmap *hm)
+static size_t _tbl_place(hm_table *t, hm_entry e, size_t *max_probe, size_t *tombstones)
 {
-    size_t old_cap = hm->capacity;
-    size_t new_cap = hm->capacity << 1;
+    return _tbl_place_until(t, &e, (size_t)-1, max_probe, tombstones);
+}
 
-    if (!new_cap){
-        new_cap = HM_INITIAL_CAPACITY;      // just this once to init everything
+/* The same for an HM_ORDERED map: what goes in a slot, and gets pushed on,
+ * is the position pos of the entry in items, the entries don't move */
+static size_t _tbl_place_index(hm_table *t, uint32_t pos, size_t *max_probe, size_t *tombstones)
+{
+    size_t g = _home_group(t, t->items[pos].hash);
+    size_t dist = 0;
+    size_t slot = (size_t)-1;
+
+    for (;;) {
+        unsigned fm = _group_match_free(t->ctrl + g);
+        if (fm) {
+            size_t idx = g + _lowest(fm);
+            if (t->ctrl[idx] == HM_CTRL_DELETED)
+                (*tombstones)--;
+            t->index[idx] = pos;
+            t->ctrl[idx]  = H2(t->items[pos].hash);
+            if (dist > *max_probe) *max_probe = dist;
+            return slot != (size_t)-1 ? slot : idx;
+        }
+
+        size_t rich = (size_t)-1, rich_dist = dist;
+        for (size_t i = g; i < g + HM_GROUP_WIDTH; i++) {
+            size_t d = _group_dist(t, g, t->items[t->index[i]].hash);
+            if (d < rich_dist) {
+                rich = i;
+                rich_dist = d;
+            }
+        }
+        if (rich != (size_t)-1) {
+            if (slot == (size_t)-1)
+                slot = rich;
+            uint32_t evicted = t->index[rich];
+            t->index[rich] = pos;
+            t->ctrl[rich]  = H2(t->items[pos].hash);
+            if (dist > *max_probe) *max_probe = dist;
+            pos = evicted;
+            dist = rich_dist;
+        }
+
+        g = _next_group(t, g);
+        dist++;
     }
+}
 
-    hm_entry *old_items = hm->items;
-    hm_entry *new_items = calloc(new_cap, sizeof *new_items);
-    if(!new_items) return -1;
+/* --- Insertion order (HM_ORDERED) ---
+ *
+ * The entries sit in items in the order they were put, and the table only
+ * holds 4 byte positions into it, next to the control bytes. Probing works
+ * as ever, an entry is one more indirection away. A remove leaves a hole in
+ * items, marked by len; holes are squeezed out when the index is rebuilt,
+ * which is all a resize does, or when they are half of items.
+ * */
+#define HM_HOLE ((size_t)-1)
 
-    hm->items = new_items;
-    hm->capacity = new_cap;
-    hm->count = 0; // will re count when reinserting
+/* Moves the entries down over the holes, in order */
+static void _hm_squeeze(hashmap *hm)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < hm->used; i++)
+        if (hm->items[i].len != HM_HOLE)
+            hm->items[n++] = hm->items[i];
+    hm->used = n;
+}
 
-    /* With new capacity all the indexes is invalidated and needs to be
-     * refreshed. Every entry needs a place according to their new index */
-    for (size_t i = 0; i < old_cap; i++) {
-        hm_entry *e = &old_items[i];
-        if (!e->key || e->key == TOMBSTONE)
-            continue;
+/* Room for n entries in items, without counting holes */
+static int _hm_dense_reserve(hashmap *hm, size_t n)
+{
+    if (n <= hm->entries_cap)
+        return 0;
+    if (n > UINT32_MAX)
+        return -1;
+    const hm_allocator *a = _hm_alloc_of(hm);
+    hm_entry *items = hm->items
+        ? _hm_realloc(a, hm->items, hm->entries_cap * sizeof *items, n * sizeof *items)
+        : _hm_malloc(a, n * sizeof *items);
+    if (!items) return -1;
+    hm->items = items;
+    hm->entries_cap = n;
+    return 0;
+}
+
+/* --- Incremental resize ---
+ *
+ * With HM_INCREMENTAL a resize only allocates the new table. The old one
+ * stays around and every put/get/remove moves the next HM_MIGRATE_GROUPS
+ * groups of it over, so no single call pays for the whole rehash. Until it
+ * is drained a key may be in either table and lookups check both.
+ *
+ * Moved slots are marked DELETED rather than EMPTY in the old table, so the
+ * probe chains of the keys still in it stay intact.
+ * */
+#define HM_MIGRATE_GROUPS 2
+
+#define _hm_migrating(hm) ((hm)->old_items != NULL)
+
+static void _hm_migrate(hashmap *hm, size_t groups)
+{
+    hm_table new_t = _hm_table(hm);
+    size_t end = hm->migrated + groups * HM_GROUP_WIDTH;
+    if (end > hm->old_capacity) end = hm->old_capacity;
 
-        /* reinsert WITHOUT copying key or value */
-        size_t idx = e->hash & (new_cap - 1);
-        while (new_items[idx].key)
-            idx = (idx + 1) & (new_cap - 1);
+    for (size_t g = hm->migrated; g < end; g += HM_GROUP_WIDTH) {
+        for (unsigned m = _group_match_full(hm->old_ctrl + g); m; m &= m - 1) {
+            size_t i = g + _lowest(m);
+            _tbl_place(&new_t, hm->old_items[i], &hm->max_probe, &hm->tombstones);
+            hm->old_ctrl[i] = HM_CTRL_DELETED;
+        }
+    }
+    hm->migrated = end;
 
-        new_items[idx] = *e;   /* copies key ptr, value, and hash */
-        hm->count++;
+    if (hm->migrated == hm->old_capacity) {
+        _hm_free(hm->allocator, hm->old_items, _hm_table_bytes(hm->old_capacity));
+        hm->old_items = NULL;
+        hm->old_ctrl = NULL;
+        hm->old_capacity = 0;
+        hm->old_max_probe = 0;
+        hm->migrated = 0;
     }
+}
 
-    free(old_items);
-    return 0;
+/* Finds key in the map, in the old table too while migrating. Returns the
+ * slot or (size_t)-1, and the table it is in through t. */
+static size_t _hm_find(hashmap *hm, const hm_key *k, hm_table *t)
+{
+    *t = _hm_table(hm);
+    size_t idx = _tbl_find(t, k);
+    if (idx == (size_t)-1 && _hm_migrating(hm)) {
+        *t = _hm_old_table(hm);
+        idx = _tbl_find(t, k);
+    }
+    return idx;
 }
 
-/* Creates a load factor of 70% making sure its a sweet spot for linear probing */
-#define LOAD_FACTOR_NUM 7
-#define LOAD_FACTOR_DEN 10
+/* --- Lock-free readers (HM_CONCURRENT) ---
+ *
+ * Lookups take no lock at all. Writers take the map's write lock, so there
+ * is only ever one, and they publish everything readers can see atomically:
+ *
+ *   - a new entry is written first, then its control byte with a release
+ *     store, so a reader that sees the tag also sees the entry,
+ *   - once published an entry's key never changes: removes only turn the
+ *     control byte DELETED, and inserts take EMPTY slots only (no tombstone
+ *     reuse, no Robin Hood moves), so a reader can never see a slot change
+ *     keys under it. Tombstones are cleared by the same-size rebuild,
+ *   - values are stored and loaded atomically,
+ *   - a resize builds the new table on the side and swaps a pointer to it.
+ *
+ * Memory a reader might still be looking at (the old table after a resize,
+ * removed keys in the arena, arena chunks after hm_compact) is only freed
+ * after a grace period, epoch based: readers bump a counter for the current
+ * epoch's parity while they look, and the writer flips the epoch and waits
+ * for the old parity's counters to drain. A reader that enters after the
+ * flip sees the new table, so when they are zero nobody can hold the old one.
+ * The counter, epoch and table pointer accesses are all seq_cst for that:
+ * either the writer sees the reader's count or the reader sees the new table.
+ * That only holds for one flip, so a reader checks the epoch again after
+ * bumping its counter, see _epoch_enter.
+ * */
+#define HM_EPOCH_SLOTS  64      // reader counters, threads share them by slot
+#define HM_RETIRE_BATCH 256     // removed keys held back before a grace period
 
-/* Inserts a key-value pair into the map. */
-int hm_put(hashmap *hm, const char *key, uintptr_t value)
+typedef struct {
+    _Alignas(64) _Atomic size_t n[2];   // readers inside, per epoch parity
+} hm_reader_slot;
+
+typedef struct {
+    pthread_mutex_t write_lock;
+    _Atomic(hm_table *) table;          // what readers see, one of views
+    hm_table views[2];                  // the other is free after a publish
+    _Atomic size_t epoch;
+    hm_reader_slot readers[HM_EPOCH_SLOTS];
+
+    /* removed long keys, back to the arena after the next grace period */
+    struct { void *p; size_t sz; } *retired;
+    size_t nretired, retired_cap;
+
+    void *mem;      // as allocated, the struct is aligned up in it
+} hm_sync;
+
+#define HM_SYNC_BYTES (sizeof(hm_sync) + _Alignof(hm_sync) - 1)
+
+#define _atomic_u8(p)  ((_Atomic uint8_t *)(p))
+#define _atomic_uptr(p) ((_Atomic uintptr_t *)(p))
+
+/* each thread gets a fixed counter slot the first time it reads */
+static unsigned _reader_slot(void)
 {
-    if (!hm->arena)
-        _arena_init(hm);
+    static _Atomic unsigned next;
+    static _Thread_local unsigned slot = (unsigned)-1;
+    if (slot == (unsigned)-1)
+        slot = atomic_fetch_add_explicit(&next, 1, memory_order_relaxed) % HM_EPOCH_SLOTS;
+    return slot;
+}
 
-    if (hm->count * LOAD_FACTOR_DEN >= hm->capacity * LOAD_FACTOR_NUM)
-        _hm_resize(hm);
+/* Enters a read-side critical section, returns the token for _epoch_exit */
+static inline unsigned _epoch_enter(hm_sync *s)
+{
+    unsigned slot = _reader_slot();
+    for (;;) {
+        unsigned parity = atomic_load(&s->epoch) & 1;
+        atomic_fetch_add(&s->readers[slot].n[parity], 1);
+        /* A writer may have flipped the epoch between the load and the add,
+         * and scanned this counter before it went up. Then a second writer
+         * flipping back only waits on the other parity, and could free a
+         * table we are about to load. Still the same parity after the add
+         * means any flip from now on sees us. */
+        if ((atomic_load(&s->epoch) & 1) == parity)
+            return slot << 1 | parity;
+        atomic_fetch_sub_explicit(&s->readers[slot].n[parity], 1, memory_order_release);
+    }
+}
 
-    return _hm_set_entry(hm, key, value);
+static inline void _epoch_exit(hm_sync *s, unsigned token)
+{
+    atomic_fetch_sub_explicit(&s->readers[token >> 1].n[token & 1], 1, memory_order_release);
 }
 
-/* Returns the value associated with key, or null */
-uintptr_t hm_get(hashmap *hm, const char *key)
+/* Waits until no reader can still see anything unpublished before the call */
+static void _epoch_synchronize(hm_sync *s)
 {
-    if (hm->capacity == 0) return 0;
+    size_t parity = atomic_fetch_add(&s->epoch, 1) & 1;
+    for (unsigned i = 0; i < HM_EPOCH_SLOTS; i++)
+        while (atomic_load(&s->readers[i].n[parity]))
+            sched_yield();
+}
 
-    size_t hash = hash_key(key);
-    size_t hash_index = hash & (hm->capacity-1);
+/* Gives every retired key back to the arena, after a grace period */
+static void _hm_reclaim(hashmap *hm)
+{
+    hm_sync *s = hm->sync;
+    if (!s->nretired) return;
+    _epoch_synchronize(s);
+    for (size_t i = 0; i < s->nretired; i++)
+        _arena_release(hm->arena, s->retired[i].p, s->retired[i].sz);
+    s->nretired = 0;
+}
 
-    hm_entry *e = &hm->items[hash_index];
+/* A removed key may still be compared by a reader, so it waits */
+static void _hm_retire_key(hashmap *hm, void *p, size_t sz)
+{
+    hm_sync *s = hm->sync;
+    if (s->nretired == s->retired_cap) {
+        size_t cap = s->retired_cap ? s->retired_cap * 2 : HM_RETIRE_BATCH;
+        void *r = _hm_realloc(hm->allocator, s->retired,
+                              s->retired_cap * sizeof *s->retired, cap * sizeof *s->retired);
+        if (!r) return;     // not reused then, still freed with the arena
+        s->retired = r;
+        s->retired_cap = cap;
+    }
+    s->retired[s->nretired].p = p;
+    s->retired[s->nretired].sz = sz;
+    if (++s->nretired >= HM_RETIRE_BATCH)
+        _hm_reclaim(hm);
+}
 
-    while (e->key)
-    {
-        if (e->key != TOMBSTONE && e->hash == hash){
-            if (match(e->key, key))
-            {
-                return e->value;
-            }
-        }
-        hash_index = (hash_index + 1) & (hm->capacity-1);
-        e = &hm->items[hash_index];
+/* Makes the map's current table the one readers see, and frees old_items
+ * (the table it replaces, may be NULL) once no reader can be in it */
+static void _hm_publish(hashmap *hm, hm_entry *old_items, size_t old_cap)
+{
+    hm_sync *s = hm->sync;
+    hm_table *t = atomic_load_explicit(&s->table, memory_order_relaxed) == &s->views[0]
+                ? &s->views[1] : &s->views[0];
+    *t = _hm_table(hm);
+
+    atomic_store(&s->table, t);
+    _epoch_synchronize(s);
+    _hm_free(hm->allocator, old_items, _hm_table_bytes(old_cap));
+}
+
+/* Incremental resizing moves entries while readers could be on them, so the
+ * two don't go together. The seed is fixed here, readers can't set it. */
+static int _hm_sync_init(hashmap *hm)
+{
+    if (hm->flags & (HM_INCREMENTAL | HM_ORDERED))
+        return -1;
+    void *mem = _hm_calloc(_hm_alloc_of(hm), HM_SYNC_BYTES);
+    if (!mem) return -1;
+    hm_sync *s = _hm_align_up(mem, _Alignof(hm_sync));
+    s->mem = mem;
+    if (pthread_mutex_init(&s->write_lock, NULL) != 0) {
+        _hm_free(hm->allocator, mem, HM_SYNC_BYTES);
+        return -1;
     }
+    if (!hm->seed)
+        hm->seed = _hm_random_seed(hm);
+    hm->sync = s;
+    if (hm->capacity)
+        _hm_publish(hm, NULL, 0);
     return 0;
 }
 
-/* Removes the mapping for key */
-int hm_remove(hashmap *hm, const char *key)
+static void _hm_sync_free(hashmap *hm)
+{
+    hm_sync *s = hm->sync;
+    if (!s) return;
+    pthread_mutex_destroy(&s->write_lock);
+    _hm_free(hm->allocator, s->retired, s->retired_cap * sizeof *s->retired);
+    _hm_free(hm->allocator, s->mem, HM_SYNC_BYTES);
+    hm->sync = NULL;
+}
+
+#define _hm_lock(hm)   do { if ((hm)->sync) pthread_mutex_lock(&((hm_sync *)(hm)->sync)->write_lock); } while (0)
+#define _hm_unlock(hm) do { if ((hm)->sync) pthread_mutex_unlock(&((hm_sync *)(hm)->sync)->write_lock); } while (0)
+
+/* The reader's probe: same walk as _tbl_find, but a control byte at a time
+ * with acquire loads, and up to the first EMPTY (max_probe moves under it) */
+static size_t _tbl_find_shared(const hm_table *t, const hm_key *k)
 {
-    if (hm->capacity == 0) return 0;
-
-    size_t hash = hash_key(key);
-    size_t hash_index = hash & (hm->capacity-1);
-
-    hm_entry *e = &hm->items[hash_index];
-    while (e->key)
-    {
-        if(e->hash == hash){
-            if (match(e->key, key))
-            {
-                e->value = 0;
-                e->key = TOMBSTONE;
-                hm->count--;
-                return 1;
+    uint8_t h2 = H2(k->hash);
+    size_t g = _home_group(t, k->hash);
+    HM_COUNT(t->counters, finds, 1);
+
+    for (size_t n = t->capacity / HM_GROUP_WIDTH; n; n--) {
+        int empty = 0;
+        HM_COUNT(t->counters, groups, 1);
+        for (size_t i = g; i < g + HM_GROUP_WIDTH; i++) {
+            uint8_t c = atomic_load_explicit(_atomic_u8(&t->ctrl[i]), memory_order_acquire);
+            if (c == h2) {
+                hm_entry *e = &t->items[i];
+                if (e->hash == k->hash && _key_eq(e, k, NULL))
+                    return i;
+                HM_COUNT(t->counters, tag_misses, 1);
             }
+            empty |= c == HM_CTRL_EMPTY;
         }
-        hash_index = (hash_index + 1) & (hm->capacity-1);
-        e = &hm->items[hash_index];
+        if (empty)
+            break;
+        g = _next_group(t, g);
     }
-    return 0;
+    return (size_t)-1;
 }
 
-/* Frees arena, arena struct, and item array.
- * Does NOT free hashmap struct itself.
- */
-void hm_destroy(hashmap *hm)
+/* Lock-free lookup, found tells a stored 0 from a miss */
+static uintptr_t _hm_get_shared(hashmap *hm, const hm_key *k, int *found)
+{
+    hm_sync *s = hm->sync;
+    unsigned token = _epoch_enter(s);
+
+    uintptr_t v = 0;
+    hm_table *t = atomic_load(&s->table);
+    size_t idx = t ? _tbl_find_shared(t, k) : (size_t)-1;
+    if (idx != (size_t)-1)
+        v = atomic_load_explicit(_atomic_uptr(&t->items[idx].value), memory_order_relaxed);
+
+    _epoch_exit(s, token);
+    *found = idx != (size_t)-1;
+    return v;
+}
+
+/* Writer side insert into the published table: first EMPTY slot only, the
+ * entry before its control byte */
+static void _tbl_place_shared(hm_table *t, const hm_entry *e, size_t *max_probe)
 {
-    _arena_free(hm->arena);
-    free(hm->arena);
-    free(hm->items);
+    size_t g = _home_group(t, e->hash);
+    size_t dist = 0;
+    unsigned em;
+    while (!(em = _group_match_empty(t->ctrl + g))) {
+        g = _next_group(t, g);
+        dist++;
+    }
+    size_t idx = g + _lowest(em);
+    t->items[idx] = *e;
+    atomic_store_explicit(_atomic_u8(&t->ctrl[idx]), H2(e->hash), memory_order_release);
+    if (dist > *max_probe) *max_probe = dist;
+}
+
+/* --- Reverse value index (HM_VALUE_INDEX) ---
+ *
+ * value -> how many keys map to it, so hm_contains_value is a lookup instead
+ * of a scan. A small open addressing table of its own: linear probing, and
+ * since nothing else ever points into it, removals shift the run back
+ * instead of leaving tombstones. Only allocated on the first put of a map
+ * with the flag, the other maps carry one NULL pointer.
+ * */
+#define HM_VALUE_INDEX_MIN 64
+
+typedef struct {
+    uintptr_t value;
+    size_t refs;        // 0 = empty slot
+} hm_value_ref;
+
+typedef struct {
+    hm_value_ref *slots;
+    size_t capacity;    // power of 2
+    size_t count;       // distinct values
+} hm_value_index;
+
+/* Values are often small integers or aligned pointers, so mix all the bits */
+static inline size_t _value_hash(uintptr_t v)
+{
+    uint64_t x = (uint64_t)v;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return (size_t)x;
+}
+
+/* The slot holding v, or the empty one where it would go */
+static size_t _vidx_slot(const hm_value_index *vi, uintptr_t v)
+{
+    size_t mask = vi->capacity - 1;
+    size_t i = _value_hash(v) & mask;
+    while (vi->slots[i].refs && vi->slots[i].value != v)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/* Makes room for n more distinct values (at most 3/4 full), allocating the
+ * index the first time */
+static int _vidx_reserve(hashmap *hm, size_t n)
+{
+    hm_value_index *vi = hm->value_index;
+    if (!vi) {
+        vi = _hm_calloc(_hm_alloc_of(hm), sizeof *vi);
+        if (!vi) return -1;
+        hm->value_index = vi;
+    }
+    if ((vi->count + n) * 4 <= vi->capacity * 3)
+        return 0;
+
+    size_t cap = vi->capacity ? vi->capacity : HM_VALUE_INDEX_MIN;
+    while ((vi->count + n) * 4 > cap * 3)
+        cap <<= 1;
+
+    hm_value_index grown = { _hm_calloc(hm->allocator, cap * sizeof(hm_value_ref)), cap, vi->count };
+    if (!grown.slots) return -1;
+    for (size_t i = 0; i < vi->capacity; i++)
+        if (vi->slots[i].refs)
+            grown.slots[_vidx_slot(&grown, vi->slots[i].value)] = vi->slots[i];
+
+    _hm_free(hm->allocator, vi->slots, vi->capacity * sizeof(hm_value_ref));
+    *vi = grown;
+    return 0;
+}
+
+/* Counts one more key mapped to v, room must have been reserved */
+static void _vidx_add(hashmap *hm, uintptr_t v)
+{
+    hm_value_index *vi = hm->value_index;
+    hm_value_ref *r = &vi->slots[_vidx_slot(vi, v)];
+    if (!r->refs++) {
+        r->value = v;
+        vi->count++;
+    }
+}
+
+/* One key less mapped to v. The last one frees the slot, and whatever
+ * follows in the run moves back into it if that keeps it at or past home. */
+static void _vidx_drop(hashmap *hm, uintptr_t v)
+{
+    hm_value_index *vi = hm->value_index;
+    size_t mask = vi->capacity - 1;
+    size_t i = _vidx_slot(vi, v);
+    if (!vi->slots[i].refs || --vi->slots[i].refs)
+        return;
+
+    for (size_t j = (i + 1) & mask; vi->slots[j].refs; j = (j + 1) & mask) {
+        size_t home = _value_hash(vi->slots[j].value) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            vi->slots[i] = vi->slots[j];
+            i = j;
+        }
+    }
+    vi->slots[i] = (hm_value_ref){0};
+    vi->count--;
+}
+
+/* Keeps the index up to date when a key's value goes from old to value */
+static inline void _hm_value_changed(hashmap *hm, uintptr_t old, uintptr_t value)
+{
+    if (hm->value_index && old != value) {
+        _vidx_drop(hm, old);
+        _vidx_add(hm, value);
+    }
+}
+
+static void _vidx_free(hashmap *hm)
+{
+    hm_value_index *vi = hm->value_index;
+    if (!vi) return;
+    _hm_free(hm->allocator, vi->slots, vi->capacity * sizeof(hm_value_ref));
+    _hm_free(hm->allocator, vi, sizeof *vi);
+    hm->value_index = NULL;
+}
+
+/* Empties slot idx of table t.
+ *
+ * A tombstone is only needed if some key's probe went past this group on its
+ * way to its slot. Probes stop at the first group with an EMPTY, and no group
+ * a key probed past ever gets a new EMPTY, so if the group already has one
+ * nobody can have gone past it and the slot can simply be EMPTY again. Under
+ * churn at a sane load most groups have an empty slot, so most removes leave
+ * no tombstone at all. The rest are counted, see hm_put. */
+static void _hm_erase(hashmap *hm, hm_table *t, size_t idx)
+{
+    hm_entry *e = _tbl_entry(t, idx);
+    hm->count--;
+    if (hm->value_index)
+        _vidx_drop(hm, e->value);
+
+    /* readers may be looking at the entry: it stays as it is, the slot is
+     * not reused until the next rebuild, and the key waits for a grace period */
+    if (hm->sync) {
+        atomic_store_explicit(_atomic_u8(&t->ctrl[idx]), HM_CTRL_DELETED, memory_order_release);
+        hm->tombstones++;
+        if (!_hm_inline(hm, e->len))
+            _hm_retire_key(hm, e->key - _hm_key_head(hm), _hm_key_bytes(hm, e->len));
+        return;
+    }
+
+    if (!_hm_inline(hm, e->len))
+        _arena_release(hm->arena, e->key - _hm_key_head(hm), _hm_key_bytes(hm, e->len));
+    *e = (hm_entry){0};
+    if (t->index) {
+        e->len = HM_HOLE;
+        while (hm->used && hm->items[hm->used - 1].len == HM_HOLE)
+            hm->used--;
+    }
+
+    /* the old table of an incremental resize is going away anyway */
+    if (t->items != hm->items) {
+        t->ctrl[idx] = HM_CTRL_DELETED;
+        return;
+    }
+
+    if (_group_match_empty(t->ctrl + (idx & ~(size_t)(HM_GROUP_WIDTH - 1)))) {
+        t->ctrl[idx] = HM_CTRL_EMPTY;
+    } else {
+        t->ctrl[idx] = HM_CTRL_DELETED;
+        hm->tombstones++;
+    }
+}
+
+/* Checks if the map contains a map to key */
+int hm_contains_key_hashed(hashmap *hm, const char *key, size_t len, size_t hash)
+{
+    hm_key k = _hm_map_key(hm, key, len, hash);
+    if (hm->sync) {
+        int found;
+        _hm_get_shared(hm, &k, &found);
+        return found;
+    }
+
+    if (_hm_migrating(hm))
+        _hm_migrate(hm, HM_MIGRATE_GROUPS);
+
+    hm_table t;
+    return _hm_find(hm, &k, &t) != (size_t)-1;
+}
+
+int hm_contains_key_n(hashmap *hm, const char *key, size_t len)
+{
+    return hm_contains_key_hashed(hm, key, len, hash_key(hm, key, len));
+}
+
+int hm_contains_key(hashmap *hm, const char *key)
+{
+    return hm_contains_key_n(hm, key, strlen(key));
+}
+
+static int _tbl_contains_value(const hm_table *t, uintptr_t value)
+{
+    for (size_t g = 0; g < t->capacity; g += HM_GROUP_WIDTH) {
+        for (unsigned m = _group_match_full(t->ctrl + g); m; m &= m - 1)
+            if (_tbl_entry(t, g + _lowest(m))->value == value) return 1;
+    }
+    return 0;
+}
+
+/* Same scan for readers of a concurrent map, a byte at a time */
+static int _tbl_contains_value_shared(const hm_table *t, uintptr_t value)
+{
+    for (size_t i = 0; i < t->capacity; i++) {
+        uint8_t c = atomic_load_explicit(_atomic_u8(&t->ctrl[i]), memory_order_acquire);
+        if ((c & 0x80) &&
+            atomic_load_explicit(_atomic_uptr(&t->items[i].value), memory_order_relaxed) == value)
+            return 1;
+    }
+    return 0;
+}
+
+/* Checks if the map contains one or more items->keys mapped to value. */
+int hm_contains_value(hashmap *hm, uintptr_t value)
+{
+    /* the index belongs to the writers, so readers of a concurrent map
+     * line up with them for it */
+    if (hm->flags & HM_VALUE_INDEX) {
+        _hm_lock(hm);
+        hm_value_index *vi = hm->value_index;
+        int r = vi && vi->slots[_vidx_slot(vi, value)].refs != 0;
+        _hm_unlock(hm);
+        return r;
+    }
+
+    if (hm->sync) {
+        hm_sync *s = hm->sync;
+        unsigned token = _epoch_enter(s);
+        hm_table *t = atomic_load(&s->table);
+        int r = t && _tbl_contains_value_shared(t, value);
+        _epoch_exit(s, token);
+        return r;
+    }
+
+    hm_table t = _hm_table(hm), old = _hm_old_table(hm);
+    return _tbl_contains_value(&t, value) || _tbl_contains_value(&old, value);
+}
+
+
+/* Internal helper to set an entry */
+static int _hm_set_entry(hashmap *hm, const hm_key *k, uintptr_t value)
+{
+    hm_table t = _hm_table(hm);
+
+    size_t idx = _tbl_find(&t, k);
+    if (idx != (size_t)-1) {
+        // found existing key -> overwrite
+        hm_entry *e = _tbl_entry(&t, idx);
+        HM_COUNT(&hm->counters, overwrites, 1);
+        _hm_value_changed(hm, e->value, value);
+        if (hm->sync)
+            atomic_store_explicit(_atomic_uptr(&e->value), value, memory_order_relaxed);
+        else
+            e->value = value;
+        return 1;  // overwrite
+    }
+
+    hm_entry e = { .value = value, .hash = k->hash };
+    if (_key_store(hm, &e, k) < 0)
+        return -1;
+    if (hm->sync)
+        _tbl_place_shared(&t, &e, &hm->max_probe);
+    else if (t.index) {
+        hm->items[hm->used] = e;
+        _tbl_place_index(&t, (uint32_t)hm->used++, &hm->max_probe, &hm->tombstones);
+    } else
+        _tbl_place(&t, e, &hm->max_probe, &hm->tombstones);
+    hm->count++;
+    HM_COUNT(&hm->counters, inserts, 1);
+    if (hm->value_index)
+        _vidx_add(hm, value);
+    return 0;   // new insert
+}
+
+/* Creates a load factor of 87.5%. Past 70% plain linear probing falls apart,
+ * but with groups of 16 and Robin Hood placement the probes stay short */
+#define HM_DEFAULT_MAX_LOAD 0.875f
+
+/* Number of keys plus tombstones at which a table of cap slots is full */
+static size_t _hm_grow_at(const hashmap *hm, size_t cap)
+{
+    float load = hm->max_load > 0 ? hm->max_load : HM_DEFAULT_MAX_LOAD;
+    size_t at = (size_t)((double)cap * load);
+    return at < cap ? at : cap - 1;
+}
+
+/* Smallest table that holds n keys without going over the load factor */
+static size_t _hm_cap_for(const hashmap *hm, size_t n)
+{
+    size_t cap = HM_GROUP_WIDTH;
+    while (_hm_grow_at(hm, cap) <= n)
+        cap <<= 1;
+    return cap;
+}
+
+static int _hm_rehash(hashmap *hm, const hm_table *old);
+
+/* Tables from this many slots up are worth rehashing on more threads */
+#define HM_REHASH_PARALLEL_MIN (1u << 16)
+
+/* Reindexing when resizing, to new_cap slots. Also used at the same capacity
+ * to get rid of tombstones: the rebuilt table has none. */
+static int _hm_rebuild(hashmap *hm, size_t new_cap)
+{
+    /* an unfinished incremental resize has to be drained first */
+    if (_hm_migrating(hm))
+        _hm_migrate(hm, hm->old_capacity / HM_GROUP_WIDTH);
+    if ((hm->flags & HM_ORDERED) && (hm->flags & HM_INCREMENTAL))
+        return -1;
+
+    hm_table old = _hm_table(hm), new_t;
+
+    if (!new_cap){
+        new_cap = HM_INITIAL_CAPACITY;      // just this once to init everything
+    }
+
+    int parallel = hm->resize_threads > 1 && old.capacity && new_cap >= old.capacity
+                && new_cap >= HM_REHASH_PARALLEL_MIN && !(hm->flags & (HM_ORDERED | HM_INCREMENTAL));
+    if (_hm_alloc_table(hm, &new_t, new_cap, !parallel) < 0)
+        return -1;
+
+    hm->items = new_t.items;
+    hm->ctrl = new_t.ctrl;
+    hm->capacity = new_cap;
+    hm->grow_at = _hm_grow_at(hm, new_cap);
+    hm->tombstones = 0;
+    hm->max_probe = 0;
+
+    /* ordered: only the index is new, the entries just lose their holes */
+    if (hm->flags & HM_ORDERED) {
+        hm->index = new_t.index;
+        _hm_squeeze(hm);
+        for (size_t i = 0; i < hm->used; i++)
+            _tbl_place_index(&new_t, (uint32_t)i, &hm->max_probe, &hm->tombstones);
+        _hm_free(hm->allocator, old.index, _hm_index_bytes(old.capacity));
+        return 0;
+    }
+
+    if ((hm->flags & HM_INCREMENTAL) && old.capacity) {
+        hm->old_items = old.items;
+        hm->old_ctrl = old.ctrl;
+        hm->old_capacity = old.capacity;
+        hm->old_max_probe = old.max_probe;
+        hm->migrated = 0;
+        return 0;
+    }
+
+    /* With new capacity all the indexes is invalidated and needs to be
+     * refreshed. Every entry needs a place according to their new index */
+    if (!parallel || _hm_rehash(hm, &old) < 0) {
+        if (parallel)
+            memset(new_t.ctrl, HM_CTRL_EMPTY, new_cap);     // start over, on this thread
+        for (size_t i = 0; i < old.capacity; i++) {
+            if (!(old.ctrl[i] & 0x80))
+                continue;
+
+            /* reinsert WITHOUT copying key or value */
+            _tbl_place(&new_t, old.items[i], &hm->max_probe, &hm->tombstones);
+        }
+    }
+
+    /* readers may still be in the old table */
+    if (hm->sync) {
+        _hm_publish(hm, old.items, old.capacity);
+        return 0;
+    }
+    _hm_free(hm->allocator, old.items, _hm_table_bytes(old.capacity));
+    return 0;
+}
+
+static uint64_t _hm_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* _hm_rebuild, counted and timed for hm_stats (the first table is not a
+ * resize). Rare enough that the clock doesn't matter. */
+static int _hm_resize(hashmap *hm, size_t new_cap)
+{
+    int first = hm->capacity == 0;
+    uint64_t start = _hm_now_ns();
+    if (_hm_rebuild(hm, new_cap) < 0)
+        return -1;
+    if (!first) {
+        hm->resizes++;
+        hm->resize_ns += _hm_now_ns() - start;
+    }
+    return 0;
+}
+
+/* Hash of a key as this map computes it, for the *_hashed variants */
+size_t hm_hash(hashmap *hm, const char *key, size_t len)
+{
+    return hash_key(hm, key, len);
+}
+
+/* Everything a put does before it looks for the key: the arena, a step of
+ * an incremental resize, and growing (or rebuilding) a full table */
+static int _hm_put_prepare(hashmap *hm)
+{
+    if (!hm->arena && _arena_init(hm, 0, 0) < 0)
+        return -1;
+    if ((hm->flags & HM_VALUE_INDEX) && _vidx_reserve(hm, 1) < 0)
+        return -1;
+
+    if (_hm_migrating(hm))
+        _hm_migrate(hm, HM_MIGRATE_GROUPS);
+
+    /* tombstones fill up probe chains just like keys do, so they count
+     * toward the load. When they are most of it a rebuild at the same size
+     * clears them, otherwise we grow. */
+    if (hm->count + hm->tombstones >= hm->grow_at) {
+        size_t new_cap = hm->capacity << 1;
+        if (hm->count * 2 < hm->grow_at)
+            new_cap = hm->capacity;
+        /* out of memory: go on filling the table past its load factor,
+         * but never the last free slot, placement needs one to stop at
+         * (a concurrent map doesn't reuse tombstones, so they count) */
+        if (_hm_resize(hm, new_cap) < 0 && hm->count + hm->tombstones + 1 >= hm->capacity)
+            return -1;
+    }
+
+    /* an ordered map appends: squeeze the holes out once they are half of
+     * items, else make it twice as big */
+    if ((hm->flags & HM_ORDERED) && hm->used == hm->entries_cap) {
+        if (hm->used && hm->used - hm->count >= hm->used / 2)
+            return _hm_resize(hm, hm->capacity);
+        return _hm_dense_reserve(hm, hm->entries_cap ? hm->entries_cap * 2 : HM_GROUP_WIDTH);
+    }
+    return 0;
+}
+
+static int _hm_put(hashmap *hm, const char *key, size_t len, size_t hash, uintptr_t value)
+{
+    if (_hm_put_prepare(hm) < 0)
+        return -1;
+
+    hm_key k = _hm_map_key(hm, key, len, hash);
+
+    /* a key not moved over yet is updated where it is */
+    if (_hm_migrating(hm)) {
+        hm_table old = _hm_old_table(hm);
+        size_t idx = _tbl_find(&old, &k);
+        if (idx != (size_t)-1) {
+            _hm_value_changed(hm, old.items[idx].value, value);
+            old.items[idx].value = value;
+            return 1;
+        }
+    }
+
+    return _hm_set_entry(hm, &k, value);
+}
+
+/* Inserts a key-value pair into the map. */
+int hm_put_hashed(hashmap *hm, const char *key, size_t len, size_t hash, uintptr_t value)
+{
+    if (hm->mapping)
+        return -1;      // a mapped snapshot is read-only
+    if ((hm->flags & HM_CONCURRENT) && !hm->sync && _hm_sync_init(hm) < 0)
+        return -1;
+
+    _hm_lock(hm);
+    int r = _hm_put(hm, key, len, hash, value);
+    _hm_unlock(hm);
+    return r;
+}
+
+int hm_put_n(hashmap *hm, const char *key, size_t len, uintptr_t value)
+{
+    return hm_put_hashed(hm, key, len, hash_key(hm, key, len), value);
+}
+
+int hm_put(hashmap *hm, const char *key, uintptr_t value)
+{
+    return hm_put_n(hm, key, strlen(key), value);
+}
+
+/* Returns the value associated with key, or null */
+uintptr_t hm_get_hashed(hashmap *hm, const char *key, size_t len, size_t hash)
+{
+    hm_key k = _hm_map_key(hm, key, len, hash);
+    if (hm->sync) {
+        int found;
+        uintptr_t v = _hm_get_shared(hm, &k, &found);
+        HM_COUNT(&hm->counters, gets, 1);
+        HM_COUNT(&hm->counters, get_hits, found);
+        return v;
+    }
+
+    if (_hm_migrating(hm))
+        _hm_migrate(hm, HM_MIGRATE_GROUPS);
+
+    hm_table t;
+    size_t idx = _hm_find(hm, &k, &t);
+    HM_COUNT(&hm->counters, gets, 1);
+    HM_COUNT(&hm->counters, get_hits, idx != (size_t)-1);
+    return idx == (size_t)-1 ? 0 : _tbl_entry(&t, idx)->value;
+}
+
+uintptr_t hm_get_n(hashmap *hm, const char *key, size_t len)
+{
+    return hm_get_hashed(hm, key, len, hash_key(hm, key, len));
+}
+
+uintptr_t hm_get(hashmap *hm, const char *key)
+{
+    return hm_get_n(hm, key, strlen(key));
+}
+
+/* --- Value slots ---
+ *
+ * Pointers straight to the value in an entry, so a get-then-put (counting,
+ * summing, caching) hashes and probes once instead of twice. Not for maps
+ * whose values something else keeps track of: HM_VALUE_INDEX would miss
+ * writes through the pointer, HM_CONCURRENT readers would race with them,
+ * and a mapped snapshot is read-only.
+ * */
+#define _hm_slots_ok(hm) (!((hm)->flags & (HM_VALUE_INDEX | HM_CONCURRENT)) && !(hm)->mapping)
+
+uintptr_t *hm_get_ptr_hashed(hashmap *hm, const char *key, size_t len, size_t hash)
+{
+    if (!_hm_slots_ok(hm))
+        return NULL;
+    if (_hm_migrating(hm))
+        _hm_migrate(hm, HM_MIGRATE_GROUPS);
+
+    hm_key k = _hm_map_key(hm, key, len, hash);
+    hm_table t;
+    size_t idx = _hm_find(hm, &k, &t);
+    HM_COUNT(&hm->counters, gets, 1);
+    HM_COUNT(&hm->counters, get_hits, idx != (size_t)-1);
+    return idx == (size_t)-1 ? NULL : &_tbl_entry(&t, idx)->value;
+}
+
+uintptr_t *hm_get_ptr_n(hashmap *hm, const char *key, size_t len)
+{
+    return hm_get_ptr_hashed(hm, key, len, hash_key(hm, key, len));
+}
+
+uintptr_t *hm_get_ptr(hashmap *hm, const char *key)
+{
+    return hm_get_ptr_n(hm, key, strlen(key));
+}
+
+/* Finds key, or puts it in with the value 0, and returns its value slot */
+uintptr_t *hm_upsert_hashed(hashmap *hm, const char *key, size_t len, size_t hash, int *inserted)
+{
+    if (inserted) *inserted = 0;
+    if (!_hm_slots_ok(hm) || _hm_put_prepare(hm) < 0)
+        return NULL;
+
+    hm_key k = _hm_map_key(hm, key, len, hash);
+    hm_table t;
+    size_t idx = _hm_find(hm, &k, &t);
+    if (idx != (size_t)-1)
+        return &_tbl_entry(&t, idx)->value;
+
+    hm_entry e = { .value = 0, .hash = k.hash };
+    if (_key_store(hm, &e, &k) < 0)
+        return NULL;
+    t = _hm_table(hm);
+    if (t.index) {
+        hm->items[hm->used] = e;
+        _tbl_place_index(&t, (uint32_t)hm->used, &hm->max_probe, &hm->tombstones);
+        idx = hm->used++;
+    } else {
+        idx = _tbl_place(&t, e, &hm->max_probe, &hm->tombstones);
+    }
+    hm->count++;
+    HM_COUNT(&hm->counters, inserts, 1);
+    if (inserted) *inserted = 1;
+    return &hm->items[idx].value;
+}
+
+uintptr_t *hm_upsert_n(hashmap *hm, const char *key, size_t len, int *inserted)
+{
+    return hm_upsert_hashed(hm, key, len, hash_key(hm, key, len), inserted);
+}
+
+uintptr_t *hm_upsert(hashmap *hm, const char *key, int *inserted)
+{
+    return hm_upsert_n(hm, key, strlen(key), inserted);
+}
+
+/* --- Interning ---
+ *
+ * hm_intern puts a key (with value 0) unless it is there already, and
+ * returns the map's copy of it, see HM_INTERN above. The *_interned calls
+ * take such a copy and skip straight to the probe with its stored hash.
+ * */
+const char *hm_intern_n(hashmap *hm, const char *key, size_t len)
+{
+    if (!(hm->flags & HM_INTERN) || hm->mapping)
+        return NULL;
+    if ((hm->flags & HM_CONCURRENT) && !hm->sync && _hm_sync_init(hm) < 0)
+        return NULL;
+
+    size_t hash = hash_key(hm, key, len);
+    hm_key k = _hm_map_key(hm, key, len, hash);
+    hm_table t;
+
+    _hm_lock(hm);
+    size_t idx = _hm_find(hm, &k, &t);
+    if (idx == (size_t)-1 && _hm_put(hm, key, len, hash, 0) == 0)
+        idx = _hm_find(hm, &k, &t);
+    const char *p = idx == (size_t)-1 ? NULL : _tbl_entry(&t, idx)->key;
+    _hm_unlock(hm);
+    return p;
+}
+
+const char *hm_intern(hashmap *hm, const char *key)
+{
+    return hm_intern_n(hm, key, strlen(key));
+}
+
+size_t hm_interned_len(const char *ikey)
+{
+    return ((const hm_intern_head *)ikey - 1)->len;
+}
+
+uintptr_t hm_get_interned(hashmap *hm, const char *ikey)
+{
+    const hm_intern_head *h = (const hm_intern_head *)ikey - 1;
+    return hm_get_hashed(hm, ikey, h->len, h->hash);
+}
+
+int hm_put_interned(hashmap *hm, const char *ikey, uintptr_t value)
+{
+    const hm_intern_head *h = (const hm_intern_head *)ikey - 1;
+    return hm_put_hashed(hm, ikey, h->len, h->hash, value);
+}
+
+/* --- Shrinking ---
+ *
+ * Once removes leave the map using less than 1/HM_SHRINK_AT of what its
+ * table can hold, the table is rebuilt at the smallest size that holds twice
+ * the keys left, and the arena is compacted. That leaves a load of a quarter
+ * to a half: far enough from both growing and the next shrink that a map
+ * going up and down around one size doesn't keep resizing. Never below the
+ * capacity the map was set up with.
+ * */
+#define HM_SHRINK_AT 8
+
+static size_t _hm_compact(hashmap *hm);
+
+/* Shrinks the entries of an HM_ORDERED map to n, at least hm->used */
+static void _hm_dense_fit(hashmap *hm, size_t n)
+{
+    if (n >= hm->entries_cap || !hm->items)
+        return;
+    if (n < HM_GROUP_WIDTH) n = HM_GROUP_WIDTH;
+    hm_entry *items = _hm_realloc(hm->allocator, hm->items,
+                                  hm->entries_cap * sizeof *items, n * sizeof *items);
+    if (!items) return;     // then it stays as big as it was
+    hm->items = items;
+    hm->entries_cap = n;
+}
+
+static void _hm_shrink(hashmap *hm)
+{
+    size_t floor = hm->min_capacity ? hm->min_capacity : (HM_INITIAL_CAPACITY);
+    size_t cap = _hm_cap_for(hm, hm->count * 2);
+    if (cap < floor) cap = floor;
+    if (cap >= hm->capacity || _hm_resize(hm, cap) < 0)
+        return;
+    if (hm->flags & HM_ORDERED)
+        _hm_dense_fit(hm, hm->used * 2);
+    _hm_compact(hm);
+}
+
+/* Removes the mapping for key */
+int hm_remove_hashed(hashmap *hm, const char *key, size_t len, size_t hash)
+{
+    if (hm->mapping)
+        return 0;
+    _hm_lock(hm);
+    if (_hm_migrating(hm))
+        _hm_migrate(hm, HM_MIGRATE_GROUPS);
+
+    hm_key k = _hm_map_key(hm, key, len, hash);
+    hm_table t;
+    size_t idx = _hm_find(hm, &k, &t);
+    if (idx != (size_t)-1) {
+        _hm_erase(hm, &t, idx);
+        if (hm->count < hm->grow_at / HM_SHRINK_AT && !_hm_migrating(hm))
+            _hm_shrink(hm);
+    }
+    _hm_unlock(hm);
+    return idx != (size_t)-1;
+}
+
+int hm_remove_n(hashmap *hm, const char *key, size_t len)
+{
+    return hm_remove_hashed(hm, key, len, hash_key(hm, key, len));
+}
+
+int hm_remove(hashmap *hm, const char *key)
+{
+    return hm_remove_n(hm, key, strlen(key));
+}
+
+/* --- Iteration --- */
+
+/* Next entry from *it on, starting at *it = 0: items in order for an
+ * HM_ORDERED map, else every slot of the table and then of the old one of
+ * an incremental resize */
+int hm_next(hashmap *hm, size_t *it, const char **key, size_t *len, uintptr_t *value)
+{
+    const hm_entry *e = NULL;
+    const char *keys = hm->mapped_keys;
+
+    if (hm->flags & HM_ORDERED) {
+        while (*it < hm->used && hm->items[*it].len == HM_HOLE)
+            (*it)++;
+        if (*it < hm->used)
+            e = &hm->items[(*it)++];
+    } else {
+        while (!e && *it < hm->capacity + hm->old_capacity) {
+            size_t i = (*it)++;
+            if (i < hm->capacity) {
+                if (hm->ctrl[i] & 0x80) e = &hm->items[i];
+            } else if (hm->old_ctrl[i - hm->capacity] & 0x80) {
+                e = &hm->old_items[i - hm->capacity];
+                keys = NULL;
+            }
+        }
+    }
+    if (!e) return 0;
+
+    if (key) *key = _hm_inline(hm, e->len) ? e->ikey : _long_key(e, keys);
+    if (len) *len = e->len;
+    if (value) *value = e->value;
+    return 1;
+}
+
+/* --- Batches ---
+ *
+ * One lookup at a time leaves the CPU waiting on one cache miss at a time:
+ * the control bytes, then the entry, then maybe the key. For a batch we hash
+ * every key first and prefetch its home group's control bytes and first
+ * entries, then look for tag matches and prefetch the candidate entries,
+ * and only then resolve them one by one. By the time we get to a key its
+ * memory is (mostly) already on the way, so the misses overlap.
+ *
+ * Batches are worked through HM_BATCH keys at a time, enough to cover the
+ * memory latency without the prefetches evicting each other.
+ * */
+#define HM_BATCH 32
+
+#define _prefetch(p) __builtin_prefetch(p)
+
+/* Hashes keys[0..n) into ks and prefetches what resolving them will touch */
+static void _hm_prepare(hashmap *hm, hm_key *ks, const char *const *keys,
+                        const size_t *lens, size_t n)
+{
+    /* the table of a concurrent map can be swapped under us, and it is
+     * not worth pinning an epoch for a prefetch: don't even read its size */
+    int warm = !hm->sync && hm->capacity;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = lens ? lens[i] : strlen(keys[i]);
+        ks[i] = _hm_map_key(hm, keys[i], len, hash_key(hm, keys[i], len));
+        if (warm) {
+            size_t g = _home_group(hm, ks[i].hash);
+            _prefetch(hm->ctrl + g);
+            if (hm->index) _prefetch(hm->index + g);
+            else _prefetch(hm->items + g);
+        }
+    }
+    if (!warm) return;
+
+    /* the ctrl bytes are in by now: prefetch the first candidate entry */
+    hm_table t = _hm_table(hm);
+    for (size_t i = 0; i < n; i++) {
+        size_t g = _home_group(hm, ks[i].hash);
+        unsigned m = _group_match(hm->ctrl + g, H2(ks[i].hash));
+        if (m) _prefetch(_tbl_entry(&t, g + _lowest(m)));
+    }
+}
+
+/* Looks up n keys, values[i] is the value of keys[i] or 0. With lens NULL the
+ * keys are NUL-terminated. Returns how many were found. */
+size_t hm_get_many(hashmap *hm, const char *const *keys, const size_t *lens,
+                   uintptr_t *values, size_t n)
+{
+    hm_key ks[HM_BATCH];
+    size_t found = 0;
+
+    for (size_t b = 0; b < n; b += HM_BATCH) {
+        size_t bn = n - b < HM_BATCH ? n - b : HM_BATCH;
+        /* readers of a concurrent map leave the migration to writers */
+        if (!hm->sync && _hm_migrating(hm))
+            _hm_migrate(hm, HM_MIGRATE_GROUPS);
+        _hm_prepare(hm, ks, keys + b, lens ? lens + b : NULL, bn);
+
+        for (size_t i = 0; i < bn; i++) {
+            if (hm->sync) {
+                int hit;
+                values[b + i] = _hm_get_shared(hm, &ks[i], &hit);
+                found += hit;
+                continue;
+            }
+            hm_table t;
+            size_t idx = _hm_find(hm, &ks[i], &t);
+            values[b + i] = idx == (size_t)-1 ? 0 : _tbl_entry(&t, idx)->value;
+            found += idx != (size_t)-1;
+        }
+    }
+    return found;
+}
+
+/* Grows the table, if it has to, so n keys fit without another resize.
+ * Doesn't pin the size the way hm_reserve does, for batches sizing
+ * themselves: the map still shrinks once they are removed. */
+static int _hm_grow_for(hashmap *hm, size_t n)
+{
+    size_t cap = _hm_cap_for(hm, n);
+    if (cap < (HM_INITIAL_CAPACITY))
+        cap = HM_INITIAL_CAPACITY;      // the same floor removes shrink to
+    if (cap > hm->capacity && _hm_resize(hm, cap) < 0)
+        return -1;
+    if (hm->flags & HM_ORDERED)
+        return _hm_dense_reserve(hm, n);
+    return 0;
+}
+
+/* Inserts n key-value pairs, as hm_put each. Returns how many were new, or
+ * (size_t)-1 if an insert failed (the ones before it are in). */
+size_t hm_put_many(hashmap *hm, const char *const *keys, const size_t *lens,
+                   const uintptr_t *values, size_t n)
+{
+    hm_key ks[HM_BATCH];
+    size_t added = 0;
+
+    /* one resize up front rather than in the middle of a batch (other
+     * writers of a concurrent map change the count as we go, so not there) */
+    if (hm->mapping || (!(hm->flags & HM_CONCURRENT) && _hm_grow_for(hm, hm->count + n) < 0))
+        return (size_t)-1;
+
+    for (size_t b = 0; b < n; b += HM_BATCH) {
+        size_t bn = n - b < HM_BATCH ? n - b : HM_BATCH;
+        _hm_prepare(hm, ks, keys + b, lens ? lens + b : NULL, bn);
+
+        for (size_t i = 0; i < bn; i++) {
+            int r = hm_put_hashed(hm, ks[i].p, ks[i].len, ks[i].hash, values[b + i]);
+            if (r < 0) return (size_t)-1;
+            added += r == 0;
+        }
+    }
+    return added;
+}
+
+/* Removes n keys, as hm_remove each. Returns how many were removed. */
+size_t hm_remove_many(hashmap *hm, const char *const *keys, const size_t *lens, size_t n)
+{
+    hm_key ks[HM_BATCH];
+    size_t removed = 0;
+
+    for (size_t b = 0; b < n; b += HM_BATCH) {
+        size_t bn = n - b < HM_BATCH ? n - b : HM_BATCH;
+        _hm_prepare(hm, ks, keys + b, lens ? lens + b : NULL, bn);
+
+        for (size_t i = 0; i < bn; i++)
+            removed += hm_remove_hashed(hm, ks[i].p, ks[i].len, ks[i].hash);
+    }
+    return removed;
+}
+
+/* Copies the long keys of every entry in t into arena a */
+static int _tbl_copy_keys(hm_table *t, hm_arena *a)
+{
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (!(t->ctrl[i] & 0x80))
+            continue;
+        hm_entry *e = _tbl_entry(t, i);
+        if (e->len <= HM_INLINE_KEY)
+            continue;
+        char *p = _str_arena(a, e->key, e->len);
+        if (!p) return -1;
+        e->key = p;
+    }
+    return 0;
+}
+
+/* Rewrites the live keys into one fresh chunk and frees all the old ones,
+ * along with the free lists and whatever they held. */
+static size_t _hm_compact(hashmap *hm)
+{
+    hm_arena *old = hm->arena;
+    if (!old || (hm->flags & HM_INTERN))
+        return 0;       // interned keys don't move
+
+    /* size the new chunk to fit exactly what is live */
+    hm_table t = _hm_table(hm), ot = _hm_old_table(hm);
+    size_t live = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        hm_table *p = pass ? &ot : &t;
+        for (size_t i = 0; i < p->capacity; i++)
+            if ((p->ctrl[i] & 0x80) && _tbl_entry(p, i)->len > HM_INLINE_KEY)
+                live += _arena_round(_tbl_entry(p, i)->len + 1);
+    }
+
+    /* readers of a concurrent map may be comparing keys in the old chunks,
+     * so the new keys go into a copy of the table, published before the
+     * chunks go away */
+    hm_table copy = t;
+    if (hm->sync) {
+        if (_hm_alloc_table(hm, &copy, t.capacity, 1) < 0)
+            return 0;
+        memcpy(copy.items, t.items, t.capacity * (sizeof(hm_entry) + 1));
+    }
+
+    hm_arena fresh = {
+        .default_cap = live ? live : old->default_cap,
+        .max_cap = old->max_cap,
+        .alloc = old->alloc,
+    };
+    if (_tbl_copy_keys(&copy, &fresh) < 0 || _tbl_copy_keys(&ot, &fresh) < 0) {
+        /* keys already moved point into fresh, so keep its chunks too */
+        hm_arena_chunk **tail = &old->head;
+        while (*tail) tail = &(*tail)->next;
+        *tail = fresh.head;
+        if (copy.items != t.items)
+            _hm_free(hm->allocator, copy.items, _hm_table_bytes(copy.capacity));
+        return 0;
+    }
+
+    if (hm->sync) {
+        hm->items = copy.items;
+        hm->ctrl = copy.ctrl;
+        _hm_publish(hm, t.items, t.capacity);
+        ((hm_sync *)hm->sync)->nretired = 0;   // they were in the old chunks
+    }
+
+    size_t before = _arena_size(old);
+    size_t next_cap = old->default_cap;
+    _arena_free(old);
+    old->head = fresh.head;
+    old->default_cap = next_cap;
+    return before - _arena_size(old);
+}
+
+size_t hm_compact(hashmap *hm)
+{
+    _hm_lock(hm);
+    size_t r = _hm_compact(hm);
+    _hm_unlock(hm);
+    return r;
+}
+
+/* Smallest table for the keys there are, no tombstones, arena compacted */
+int hm_shrink_to_fit(hashmap *hm)
+{
+    if (hm->mapping)
+        return -1;
+    if (!hm->capacity)
+        return 0;
+
+    _hm_lock(hm);
+    int r = _hm_resize(hm, _hm_cap_for(hm, hm->count));
+    if (r == 0 && _hm_migrating(hm))
+        _hm_migrate(hm, hm->old_capacity / HM_GROUP_WIDTH);
+    if (r == 0 && (hm->flags & HM_ORDERED))
+        _hm_dense_fit(hm, hm->used);
+    if (r == 0)
+        _hm_compact(hm);
+    _hm_unlock(hm);
+    return r;
+}
+
+/* Removes every key and keeps the memory: the table stays the size it is
+ * and the arena's chunks are filled again from the start */
+int hm_clear(hashmap *hm)
+{
+    if (hm->mapping)
+        return -1;
+
+    _hm_lock(hm);
+    if (_hm_migrating(hm)) {
+        _hm_free(hm->allocator, hm->old_items, _hm_table_bytes(hm->old_capacity));
+        hm->old_items = NULL;
+        hm->old_ctrl = NULL;
+        hm->old_capacity = 0;
+        hm->old_max_probe = 0;
+        hm->migrated = 0;
+    }
+
+    if (hm->sync && hm->capacity) {
+        /* readers may be in the table and the keys: they get an empty one,
+         * and the arena is only rewound once they are all out of the old */
+        hm_table t;
+        if (_hm_alloc_table(hm, &t, hm->capacity, 1) < 0) {
+            _hm_unlock(hm);
+            return -1;
+        }
+        hm_entry *old = hm->items;
+        hm->items = t.items;
+        hm->ctrl = t.ctrl;
+        hm->max_probe = 0;
+        _hm_publish(hm, old, hm->capacity);
+        ((hm_sync *)hm->sync)->nretired = 0;   // they are in the arena
+    } else if (hm->capacity) {
+        memset(hm->ctrl, HM_CTRL_EMPTY, hm->capacity);
+    }
+
+    hm->count = 0;
+    hm->tombstones = 0;
+    hm->max_probe = 0;
+    hm->used = 0;
+    if (hm->value_index) {
+        hm_value_index *vi = hm->value_index;
+        memset(vi->slots, 0, vi->capacity * sizeof *vi->slots);
+        vi->count = 0;
+    }
+    if (hm->arena)
+        _arena_rewind(hm->arena);
+    _hm_unlock(hm);
+    return 0;
+}
+
+/* Sets the map up from cfg instead of the zero-initialized defaults, and
+ * allocates the table and arena right away. */
+int hm_init_ex(hashmap *hm, const hm_config *cfg)
+{
+    if (cfg->max_load < 0 || cfg->max_load >= 1)
+        return -1;
+    if ((cfg->flags & HM_INCREMENTAL) && (cfg->flags & (HM_CONCURRENT | HM_ORDERED)))
+        return -1;
+    if ((cfg->flags & HM_CONCURRENT) && (cfg->flags & HM_ORDERED))
+        return -1;
+
+    *hm = (hashmap){
+        .hasher = cfg->hasher,
+        .seed = cfg->seed,
+        .flags = cfg->flags,
+        .max_load = cfg->max_load,
+        .allocator = cfg->allocator,
+        .resize_threads = cfg->resize_threads,
+    };
+
+    if (_arena_init(hm, cfg->arena_chunk, cfg->arena_chunk_max) < 0)
+        return -1;
+    if ((hm->flags & HM_CONCURRENT) && _hm_sync_init(hm) < 0) {
+        hm_destroy(hm);
+        *hm = (hashmap){0};
+        return -1;
+    }
+
+    size_t cap = HM_INITIAL_CAPACITY;
+    if (cfg->capacity > cap) {
+        cap = HM_GROUP_WIDTH;
+        while (cap < cfg->capacity) cap <<= 1;
+    }
+    hm->min_capacity = cap;
+    if (_hm_resize(hm, cap) < 0) {
+        hm_destroy(hm);
+        *hm = (hashmap){0};
+        return -1;
+    }
+    return 0;
+}
+
+/* Grows the table once, up front, so n keys fit without another resize */
+int hm_reserve(hashmap *hm, size_t n)
+{
+    if (hm->mapping)
+        return -1;
+
+    _hm_lock(hm);
+    int r = _hm_grow_for(hm, n);
+    /* what was reserved stays: removes on the way don't shrink it away */
+    size_t cap = _hm_cap_for(hm, n);
+    if (r == 0 && cap > hm->min_capacity && cap > (HM_INITIAL_CAPACITY))
+        hm->min_capacity = cap;
+    _hm_unlock(hm);
+    return r;
+}
+
+/* Frees arena, arena struct, and item arrays (control bytes live in the same
+ * block). Does NOT free hashmap struct itself.
+ */
+void hm_destroy(hashmap *hm)
+{
+    _hm_sync_free(hm);
+    _vidx_free(hm);
+    if (hm->arena) _arena_free(hm->arena);
+    _hm_free(hm->allocator, hm->arena, sizeof(hm_arena));
+    if (hm->mapping)
+        munmap(hm->mapping, hm->mapping_size);
+    else if (hm->flags & HM_ORDERED) {
+        _hm_free(hm->allocator, hm->index, _hm_index_bytes(hm->capacity));
+        _hm_free(hm->allocator, hm->items, hm->entries_cap * sizeof(hm_entry));
+    } else
+        _hm_free(hm->allocator, hm->items, _hm_table_bytes(hm->capacity));
+    _hm_free(hm->allocator, hm->old_items, _hm_table_bytes(hm->old_capacity));
+}
+
+/* --- Parallel build ---
+ *
+ * hm_build fills a table sized for all n keys up front, in three passes that
+ * each run on every thread, with a join in between:
+ *
+ *   1. each thread hashes its slice of the keys and counts how many fall in
+ *      each partition: a contiguous range of the table, picked by the top
+ *      bits of the key's home slot
+ *   2. each thread writes the positions of its slice into the partitions'
+ *      runs of one array, at offsets worked out from the counts, so every
+ *      partition's keys end up together and in input order
+ *   3. the threads take partitions off a shared counter and place their keys
+ *      in that range of the table, copying long keys to arenas of their own
+ *
+ * A partition's keys only ever probe its own range, so no two threads touch
+ * the same slot. Placement that would run past the end of the range parks
+ * the entry it is carrying on a spill list instead, and after the join the
+ * spilled ones, a few per partition, are placed one at a time anywhere.
+ * Every copy of a key lands in the same partition, in input order, so the
+ * last one wins just as with hm_put. A key can only have spilled if the
+ * groups from its home to the end of the range are full, which is also the
+ * only case the lookup before each insert has to check the spill list.
+ *
+ * The arenas' chunks are handed to the map's arena at the end, so the result
+ * is an ordinary map.
+ * */
+#define HM_BUILD_PARTS     8        // partitions per thread, to even out skew
+#define HM_BUILD_MIN_SLICE 4096     // fewer keys per thread are not worth one
+#define HM_BUILD_MAX_THREADS 256
+
+typedef struct {
+    hashmap *hm;
+    const char *const *keys;
+    const size_t *lens;
+    const uintptr_t *values;
+    size_t *hashes;
+    uint32_t *order;        // positions of the keys, grouped by partition
+    size_t *offsets;        // [thread * nparts + p]: counts, then where to write
+    size_t *starts;         // partition p is order[starts[p] .. starts[p + 1])
+    hm_table old;           // _hm_rehash: the table the entries come from
+    size_t nparts;
+    unsigned shift;         // home slot >> shift = partition
+    _Atomic size_t next_part;
+    _Atomic int failed;
+} hm_build_job;
+
+typedef struct {
+    hm_build_job *job;
+    size_t id, lo, hi;      // slice of the keys in passes 1 and 2
+    hm_arena arena;         // only its allocator when rehashing
+    hm_entry *spill;
+    size_t nspill, spill_cap;
+    size_t added, max_probe, tombstones;
+} hm_builder;
+
+/* How many partitions a table of cap slots is cut into for threads threads,
+ * at least min and at most one per group, and the shift that takes a home
+ * slot to its partition */
+static size_t _build_parts(size_t cap, unsigned threads, size_t min, unsigned *shift)
+{
+    size_t groups = cap / HM_GROUP_WIDTH, nparts = 1;
+    while ((nparts < (size_t)threads * HM_BUILD_PARTS || nparts < min) && nparts < groups)
+        nparts <<= 1;
+    *shift = 0;
+    while (((size_t)1 << *shift) * nparts < cap) (*shift)++;
+    return nparts;
+}
+
+#define _build_part(job, hash) ((H1(hash) & ((job)->hm->capacity - 1)) >> (job)->shift)
+
+static void *_build_hash(void *arg)
+{
+    hm_builder *b = arg;
+    hm_build_job *job = b->job;
+    size_t *counts = job->offsets + b->id * job->nparts;
+    for (size_t i = b->lo; i < b->hi; i++) {
+        size_t len = job->lens ? job->lens[i] : strlen(job->keys[i]);
+        job->hashes[i] = hash_key(job->hm, job->keys[i], len);
+        counts[_build_part(job, job->hashes[i])]++;
+    }
+    return NULL;
+}
+
+static void *_build_scatter(void *arg)
+{
+    hm_builder *b = arg;
+    hm_build_job *job = b->job;
+    size_t *at = job->offsets + b->id * job->nparts;
+    for (size_t i = b->lo; i < b->hi; i++)
+        job->order[at[_build_part(job, job->hashes[i])]++] = (uint32_t)i;
+    return NULL;
+}
+
+/* _tbl_find kept inside [home, end). Sets *full when it got to end without
+ * passing an EMPTY, the one case the key could be on the spill list. */
+static size_t _build_find(const hm_table *t, const hm_key *k, size_t end, int *full)
+{
+    uint8_t h2 = H2(k->hash);
+    size_t g = _home_group(t, k->hash);
+    *full = 0;
+    do {
+        const uint8_t *ctrl = t->ctrl + g;
+        for (unsigned m = _group_match(ctrl, h2); m; m &= m - 1) {
+            const hm_entry *e = &t->items[g + _lowest(m)];
+            if (e->hash == k->hash && _key_eq(e, k, NULL))
+                return g + _lowest(m);
+        }
+        if (_group_match_empty(ctrl))
+            return (size_t)-1;
+        g = _next_group(t, g);
+    } while (g != end);
+    *full = 1;
+    return (size_t)-1;
+}
+
+static int _build_spill(hm_builder *b, const hm_entry *e)
+{
+    if (b->nspill == b->spill_cap) {
+        size_t cap = b->spill_cap ? b->spill_cap * 2 : 64;
+        hm_entry *s = _hm_realloc(b->arena.alloc, b->spill, b->spill_cap * sizeof *s, cap * sizeof *s);
+        if (!s) return -1;
+        b->spill = s;
+        b->spill_cap = cap;
+    }
+    b->spill[b->nspill++] = *e;
+    return 0;
+}
+
+/* Places the keys of partition p in its range of the table */
+static int _build_part_fill(hm_builder *b, size_t p)
+{
+    hm_build_job *job = b->job;
+    hm_table t = _hm_table(job->hm);
+    size_t end = ((p + 1) << job->shift) & (t.capacity - 1);
+    size_t first_spill = b->nspill;
+
+    for (size_t j = job->starts[p]; j < job->starts[p + 1]; j++) {
+        size_t i = job->order[j];
+        size_t len = job->lens ? job->lens[i] : strlen(job->keys[i]);
+        hm_key k = _hm_map_key(job->hm, job->keys[i], len, job->hashes[i]);
+
+        int full;
+        size_t idx = _build_find(&t, &k, end, &full);
+        if (idx != (size_t)-1) {
+            t.items[idx].value = job->values[i];
+            continue;
+        }
+        if (full) {
+            size_t s = first_spill;
+            while (s < b->nspill && !(b->spill[s].hash == k.hash && _key_eq(&b->spill[s], &k, NULL)))
+                s++;
+            if (s < b->nspill) {
+                b->spill[s].value = job->values[i];
+                continue;
+            }
+        }
+
+        hm_entry e = { .hash = k.hash, .value = job->values[i] };
+        if (_key_store_in(&b->arena, &e, &k) < 0)
+            return -1;
+        b->added++;
+
+        if (_tbl_place_until(&t, &e, end, &b->max_probe, &b->tombstones) == (size_t)-1
+            && _build_spill(b, &e) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void *_build_fill(void *arg)
+{
+    hm_builder *b = arg;
+    hm_build_job *job = b->job;
+    for (;;) {
+        size_t p = atomic_fetch_add_explicit(&job->next_part, 1, memory_order_relaxed);
+        if (p >= job->nparts || atomic_load_explicit(&job->failed, memory_order_relaxed))
+            return NULL;
+        if (_build_part_fill(b, p) < 0) {
+            atomic_store(&job->failed, 1);
+            return NULL;
+        }
+    }
+}
+
+/* Runs fn on every builder, the first on this thread. A thread that can't be
+ * started has its share run here after the others are going. */
+static void _build_run(hm_builder *bs, unsigned threads, void *(*fn)(void *))
+{
+    pthread_t th[HM_BUILD_MAX_THREADS];
+    int started[HM_BUILD_MAX_THREADS] = { 0 };
+    for (unsigned i = 1; i < threads; i++)
+        started[i] = pthread_create(&th[i], NULL, fn, &bs[i]) == 0;
+    fn(&bs[0]);
+    for (unsigned i = 1; i < threads; i++) {
+        if (started[i]) pthread_join(th[i], NULL);
+        else fn(&bs[i]);
+    }
+}
+
+/* Hands the chunks of a builder's arena to the map's, behind the chunk the
+ * map allocates from */
+static void _build_adopt(hm_arena *a, hm_arena *from)
+{
+    hm_arena_chunk *list = from->head;
+    from->head = NULL;
+    if (!list) return;
+    if (!a->head) {
+        a->head = list;
+        return;
+    }
+    hm_arena_chunk *tail = list;
+    while (tail->next) tail = tail->next;
+    tail->next = a->head->next;
+    a->head->next = list;
+}
+
+int hm_build(hashmap *hm, const hm_config *cfg, const char *const *keys, const size_t *lens,
+             const uintptr_t *values, size_t n, unsigned threads)
+{
+    hm_config c = cfg ? *cfg : (hm_config){ 0 };
+    if ((c.flags & HM_ORDERED) || n > UINT32_MAX)
+        return -1;
+
+    /* the table is made big enough for every key, and the capacity asked
+     * for is what removes may shrink it back to */
+    hashmap sizing = { .max_load = c.max_load };
+    size_t min_cap = HM_INITIAL_CAPACITY;
+    while (min_cap < c.capacity) min_cap <<= 1;
+    if (c.max_load >= 0 && c.max_load < 1 && _hm_cap_for(&sizing, n) > c.capacity)
+        c.capacity = _hm_cap_for(&sizing, n);
+    unsigned flags = c.flags;
+    c.flags &= ~HM_CONCURRENT;      // readers only get the finished map
+    if (hm_init_ex(hm, &c) < 0)
+        return -1;
+    hm->min_capacity = min_cap;
+    if (!hm->seed)
+        hm->seed = _hm_random_seed(hm);
+
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    if (threads > n / HM_BUILD_MIN_SLICE)
+        threads = n / HM_BUILD_MIN_SLICE ? (unsigned)(n / HM_BUILD_MIN_SLICE) : 1;
+    if (threads > HM_BUILD_MAX_THREADS)
+        threads = HM_BUILD_MAX_THREADS;
+
+    unsigned shift;
+    size_t nparts = _build_parts(hm->capacity, threads, 1, &shift);
+
+    const hm_allocator *alloc = hm->allocator;
+    hm_arena *arena = hm->arena;
+    hm_build_job job = {
+        .hm = hm, .keys = keys, .lens = lens, .values = values,
+        .hashes = _hm_malloc(alloc, n * sizeof(size_t)),
+        .order = _hm_malloc(alloc, n * sizeof(uint32_t)),
+        .offsets = _hm_calloc(alloc, (size_t)threads * nparts * sizeof(size_t)),
+        .starts = _hm_malloc(alloc, (nparts + 1) * sizeof(size_t)),
+        .nparts = nparts, .shift = shift,
+    };
+    hm_builder *bs = _hm_calloc(alloc, threads * sizeof *bs);
+    int ok = bs && job.offsets && job.starts && (!n || (job.hashes && job.order));
+
+    if (ok) {
+        for (unsigned i = 0; i < threads; i++) {
+            bs[i].job = &job;
+            bs[i].id = i;
+            bs[i].lo = n * i / threads;
+            bs[i].hi = n * (i + 1) / threads;
+            bs[i].arena = (hm_arena){ .default_cap = arena->default_cap,
+                                      .max_cap = arena->max_cap, .alloc = alloc };
+        }
+        _build_run(bs, threads, _build_hash);
+
+        /* counts -> offsets: partition by partition, and within one, slice by
+         * slice, which keeps the keys of a partition in input order */
+        size_t at = 0;
+        for (size_t p = 0; p < nparts; p++) {
+            job.starts[p] = at;
+            for (unsigned i = 0; i < threads; i++) {
+                size_t count = job.offsets[i * nparts + p];
+                job.offsets[i * nparts + p] = at;
+                at += count;
+            }
+        }
+        job.starts[nparts] = at;
+
+        _build_run(bs, threads, _build_scatter);
+        _build_run(bs, threads, _build_fill);
+        ok = !atomic_load(&job.failed);
+    }
+
+    /* the spilled entries, with the whole table to go to */
+    hm_table t = _hm_table(hm);
+    for (unsigned i = 0; ok && i < threads; i++) {
+        hm->count += bs[i].added;
+        if (bs[i].max_probe > hm->max_probe)
+            hm->max_probe = bs[i].max_probe;
+    }
+    for (unsigned i = 0; ok && i < threads; i++)
+        for (size_t s = 0; s < bs[i].nspill; s++)
+            _tbl_place(&t, bs[i].spill[s], &hm->max_probe, &hm->tombstones);
+
+    if (ok && (hm->flags & HM_VALUE_INDEX)) {
+        ok = _vidx_reserve(hm, hm->count) == 0;
+        for (size_t i = 0; ok && i < hm->capacity; i++)
+            if (hm->ctrl[i] & 0x80)
+                _vidx_add(hm, hm->items[i].value);
+    }
+
+    for (unsigned i = 0; bs && i < threads; i++) {
+        _build_adopt(arena, &bs[i].arena);
+        _hm_free(alloc, bs[i].spill, bs[i].spill_cap * sizeof(hm_entry));
+    }
+    _hm_free(alloc, bs, threads * sizeof *bs);
+    _hm_free(alloc, job.hashes, n * sizeof(size_t));
+    _hm_free(alloc, job.order, n * sizeof(uint32_t));
+    _hm_free(alloc, job.offsets, (size_t)threads * nparts * sizeof(size_t));
+    _hm_free(alloc, job.starts, (nparts + 1) * sizeof(size_t));
+
+    if (ok && (flags & HM_CONCURRENT)) {
+        hm->flags = flags;
+        ok = _hm_sync_init(hm) == 0;
+    }
+    if (!ok) {
+        hm_destroy(hm);
+        *hm = (hashmap){0};
+        return -1;
+    }
+    return 0;
+}
+
+/* --- Parallel rehash ---
+ *
+ * With resize_threads set, growing (or rebuilding in place) a table of at
+ * least HM_REHASH_PARALLEL_MIN slots is shared out the way hm_build fills
+ * one: the new table is cut into partitions, and each thread takes
+ * partitions off a counter and moves in every old entry whose new home is
+ * in its range, carrying any entry pushed past the end to a spill list for
+ * after the join.
+ *
+ * No list of which entries go where is needed: the new table is at least as
+ * big as the old one, so an entry's old home is its new home masked down,
+ * and the entries of a partition of R slots starting at lo had their old
+ * homes in the R slots from lo & (old capacity - 1). Robin Hood kept them
+ * within old max_probe groups of there, so a thread scans that window and
+ * max_probe + 1 groups past it, wrapping around, and skips what is not its
+ * own: runs that cross the window's edge are covered from both sides, and
+ * each entry is moved by exactly one thread. A table that doubles has two
+ * partitions per window, so the unit of work is a window, with all of its
+ * partitions, and the old table is read once rather than once for each.
+ *
+ * The table comes without its control bytes set, and each thread clears
+ * those of its own partitions before filling them, so the pages of the new
+ * table are first touched, and placed on a NUMA node, by the thread that
+ * writes them rather than all by the one that allocated. The entries of
+ * free slots are never read and are left as they are.
+ * */
+static void *_rehash_fill(void *arg)
+{
+    hm_builder *b = arg;
+    hm_build_job *job = b->job;
+    hm_table t = _hm_table(job->hm);
+    const hm_table *old = &job->old;
+    size_t size = (size_t)1 << job->shift;
+    size_t windows = job->nparts / (t.capacity / old->capacity);
+    size_t scan = size + (old->max_probe + 1) * HM_GROUP_WIDTH;
+    if (scan > old->capacity)
+        scan = old->capacity;
+
+    for (;;) {
+        size_t w = atomic_fetch_add_explicit(&job->next_part, 1, memory_order_relaxed);
+        if (w >= windows || atomic_load_explicit(&job->failed, memory_order_relaxed))
+            return NULL;
+
+        /* the window's partitions are w, w + windows, ... */
+        for (size_t p = w; p < job->nparts; p += windows)
+            memset(t.ctrl + (p << job->shift), HM_CTRL_EMPTY, size);
+
+        size_t from = w << job->shift;
+        for (size_t s = 0; s < scan; s++) {
+            size_t i = (from + s) & (old->capacity - 1);
+            if (!(old->ctrl[i] & 0x80))
+                continue;
+            size_t p = _build_part(job, old->items[i].hash);
+            if ((p & (windows - 1)) != w)
+                continue;
+            hm_entry e = old->items[i];
+            size_t end = ((p + 1) << job->shift) & (t.capacity - 1);
+            if (_tbl_place_until(&t, &e, end, &b->max_probe, &b->tombstones) == (size_t)-1
+                && _build_spill(b, &e) < 0) {
+                atomic_store(&job->failed, 1);
+                return NULL;
+            }
+        }
+    }
+}
+
+/* Moves every entry of old into the map's new table, with the control bytes
+ * not yet set, on resize_threads threads. -1 if it couldn't, and then the
+ * table is in no state to use. */
+static int _hm_rehash(hashmap *hm, const hm_table *old)
+{
+    unsigned threads = hm->resize_threads;
+    if (threads > HM_BUILD_MAX_THREADS)
+        threads = HM_BUILD_MAX_THREADS;
+
+    /* no partition bigger than the old table, see above */
+    hm_build_job job = { .hm = hm, .old = *old };
+    job.nparts = _build_parts(hm->capacity, threads, hm->capacity / old->capacity, &job.shift);
+
+    const hm_allocator *alloc = hm->allocator;
+    hm_builder *bs = _hm_calloc(alloc, threads * sizeof *bs);
+    if (!bs) return -1;
+    for (unsigned i = 0; i < threads; i++) {
+        bs[i].job = &job;
+        bs[i].arena.alloc = alloc;
+    }
+    _build_run(bs, threads, _rehash_fill);
+
+    int ok = !atomic_load(&job.failed);
+    hm_table t = _hm_table(hm);
+    for (unsigned i = 0; ok && i < threads; i++)
+        if (bs[i].max_probe > hm->max_probe)
+            hm->max_probe = bs[i].max_probe;
+    for (unsigned i = 0; i < threads; i++) {
+        for (size_t s = 0; ok && s < bs[i].nspill; s++)
+            _tbl_place(&t, bs[i].spill[s], &hm->max_probe, &hm->tombstones);
+        _hm_free(alloc, bs[i].spill, bs[i].spill_cap * sizeof(hm_entry));
+    }
+    _hm_free(alloc, bs, threads * sizeof *bs);
+    return ok ? 0 : -1;
+}
+
+/* --- Statistics ---
+ *
+ * Everything hm_stats reports that isn't kept as it goes is worked out from
+ * one pass over the control bytes (per group: the distance of every key from
+ * home, and whether it has an EMPTY, which is what ends a miss) and one over
+ * the arena's chunks and free lists.
+ * */
+static inline void _stats_add(size_t *hist, size_t groups)
+{
+    hist[groups - 1 < HM_STATS_BUCKETS ? groups - 1 : HM_STATS_BUCKETS - 1]++;
+}
+
+/* A miss from a group probes up to and including the next group with an
+ * EMPTY in it, max_probe + 1 groups at most. run groups without one, then
+ * one with: the misses from each of them. */
+static void _stats_run(hm_statistics *st, size_t run, size_t max_probe)
+{
+    for (size_t j = 0; j <= run; j++) {
+        size_t groups = (j < max_probe ? j : max_probe) + 1;
+        _stats_add(st->miss_probes, groups);
+        st->avg_miss_probes += (double)groups;
+    }
+}
+
+static void _stats_table(hm_statistics *st, const hm_table *t)
+{
+    size_t ngroups = t->capacity / HM_GROUP_WIDTH;
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (!(t->ctrl[i] & 0x80)) continue;
+        size_t d = _group_dist(t, i & ~(size_t)(HM_GROUP_WIDTH - 1), _tbl_entry(t, i)->hash);
+        _stats_add(st->hit_probes, d + 1);
+        st->avg_hit_probes += (double)(d + 1);
+    }
+
+    /* walk the groups round from one that has an EMPTY, so every run of
+     * full groups is seen whole */
+    size_t first = ngroups;
+    for (size_t g = 0; g < ngroups; g++)
+        if (_group_match_empty(t->ctrl + g * HM_GROUP_WIDTH)) { first = g; break; }
+    if (first == ngroups) {
+        st->longest_cluster = ngroups;
+        for (size_t g = 0; g < ngroups; g++) {
+            _stats_add(st->miss_probes, t->max_probe + 1);
+            st->avg_miss_probes += (double)(t->max_probe + 1);
+        }
+        return;
+    }
+
+    size_t run = 0;
+    for (size_t n = 1; n <= ngroups; n++) {
+        size_t g = (first + n) % ngroups;
+        if (_group_match_empty(t->ctrl + g * HM_GROUP_WIDTH)) {
+            _stats_run(st, run, t->max_probe);
+            run = 0;
+        } else if (++run > st->longest_cluster) {
+            st->longest_cluster = run;
+        }
+    }
+}
+
+static void _stats_arena(hm_statistics *st, const hm_arena *a)
+{
+    for (const hm_arena_chunk *c = a->head; c; c = c->next) {
+        st->arena_chunks++;
+        st->arena_bytes += c->cap;
+    }
+    for (const hm_arena_chunk *c = a->spare; c; c = c->next) {
+        st->arena_chunks++;
+        st->arena_bytes += c->cap;
+        st->arena_free += c->cap;
+    }
+    for (size_t cls = 0; cls < HM_ARENA_CLASSES; cls++)
+        for (void *p = a->free[cls]; p; memcpy(&p, p, sizeof p))
+            st->arena_free += cls * 8;
+}
+
+/* Fills st with a picture of the map as it is now: load, probe lengths,
+ * clustering, resizes and arena use. Goes over the whole table, so it is
+ * for diagnostics, not for every request. */
+void hm_stats(hashmap *hm, hm_statistics *st)
+{
+    const hm_counters *c = &hm->counters;
+    _hm_lock(hm);
+    *st = (hm_statistics){
+        .count = hm->count,
+        .capacity = hm->capacity,
+        .tombstones = hm->tombstones,
+        .max_probe = hm->max_probe,
+        .resizes = hm->resizes,
+        .resize_ns = hm->resize_ns,
+        .counters = {
+            HM_COUNTED(c, finds), HM_COUNTED(c, groups), HM_COUNTED(c, tag_misses),
+            HM_COUNTED(c, gets), HM_COUNTED(c, get_hits),
+            HM_COUNTED(c, inserts), HM_COUNTED(c, overwrites),
+        },
+    };
+    if (hm->flags & HM_ORDERED)
+        st->table_bytes = _hm_index_bytes(hm->capacity) + hm->entries_cap * sizeof(hm_entry);
+    else
+        st->table_bytes = _hm_table_bytes(hm->capacity) + _hm_table_bytes(hm->old_capacity);
+    if (hm->capacity) {
+        st->load = (double)(hm->count + hm->tombstones) / (double)hm->capacity;
+        hm_table t = _hm_table(hm);
+        _stats_table(st, &t);
+        st->avg_miss_probes /= (double)(hm->capacity / HM_GROUP_WIDTH);
+    }
+
+    /* live keys in both tables, the old one still holds some mid-resize */
+    hm_table tabs[2] = { _hm_table(hm), _hm_old_table(hm) };
+    size_t keys = 0;
+    for (int i = 0; i < 2; i++)
+        for (size_t s = 0; s < tabs[i].capacity; s++) {
+            if (!(tabs[i].ctrl[s] & 0x80)) continue;
+            keys += i == 0;
+            const hm_entry *e = _tbl_entry(&tabs[i], s);
+            if (hm->arena && !_hm_inline(hm, e->len))
+                st->arena_live += _arena_round(_hm_key_bytes(hm, e->len));
+        }
+    if (keys)
+        st->avg_hit_probes /= (double)keys;
+
+    if (hm->arena) {
+        _stats_arena(st, hm->arena);
+        st->arena_wasted = st->arena_bytes - st->arena_live - st->arena_free;
+    }
+    _hm_unlock(hm);
+}
+
+/* --- Snapshots ---
+ *
+ * File layout, in the byte order and entry layout of the machine that wrote
+ * it (both are checked on open):
+ *
+ *     hm_snapshot_header
+ *     ctrl    capacity bytes
+ *     items   capacity hm_entry, long keys as offsets into the blob
+ *     keys    the long keys, NUL-terminated, back to back
+ *
+ * The control bytes and entries are the table as it is in memory, probe
+ * order and all, so hm_open_mmap has nothing to rebuild: it maps the file
+ * and points the map at it. Pages are only read in when a lookup touches
+ * them, and every process mapping the same file shares them.
+ * */
+#define HM_SNAPSHOT_MAGIC   "HMSNAP\0\0"
+#define HM_SNAPSHOT_VERSION 1
+#define HM_SNAPSHOT_ORDER   0x01020304u
+
+enum { HM_SNAPSHOT_WYHASH, HM_SNAPSHOT_FNV1A };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    // HM_SNAPSHOT_ORDER as the writer saw it
+    uint32_t entry_size;    // sizeof(hm_entry)
+    uint32_t hasher;        // HM_SNAPSHOT_*, a custom hasher can't be saved
+    uint64_t seed;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t tombstones;
+    uint64_t max_probe;
+    uint64_t keys_size;     // bytes in the key blob
+} hm_snapshot_header;
+
+static int _snapshot_write(hashmap *hm, FILE *f)
+{
+    hm_table t = _hm_table(hm);
+    hm_snapshot_header h = {
+        .magic = HM_SNAPSHOT_MAGIC,
+        .version = HM_SNAPSHOT_VERSION,
+        .byte_order = HM_SNAPSHOT_ORDER,
+        .entry_size = sizeof(hm_entry),
+        .hasher = hm->hasher == hm_hash_fnv1a ? HM_SNAPSHOT_FNV1A : HM_SNAPSHOT_WYHASH,
+        .seed = hm->seed,
+        .capacity = t.capacity,
+        .count = hm->count,
+        .tombstones = hm->tombstones,
+        .max_probe = t.max_probe,
+    };
+    for (size_t i = 0; i < t.capacity; i++)
+        if ((t.ctrl[i] & 0x80) && _tbl_entry(&t, i)->len > HM_INLINE_KEY)
+            h.keys_size += _tbl_entry(&t, i)->len + 1;
+
+    if (fwrite(&h, sizeof h, 1, f) != 1 || fwrite(t.ctrl, 1, t.capacity, f) != t.capacity)
+        return -1;
+
+    /* free slots are written zeroed, whatever was left in them */
+    uint64_t off = 0;
+    for (size_t i = 0; i < t.capacity; i++) {
+        hm_entry e = {0};
+        if (t.ctrl[i] & 0x80) {
+            e = *_tbl_entry(&t, i);
+            if (e.len > HM_INLINE_KEY) {
+                e.key = (char *)(uintptr_t)off;
+                off += e.len + 1;
+            } else if (!_hm_inline(hm, e.len)) {
+                /* an interned short key goes in the file inline */
+                const char *key = e.key;
+                memset(e.ikey, 0, sizeof e.ikey);
+                memcpy(e.ikey, key, e.len);
+            }
+        }
+        if (fwrite(&e, sizeof e, 1, f) != 1)
+            return -1;
+    }
+
+    for (size_t i = 0; i < t.capacity; i++) {
+        const hm_entry *e = _tbl_entry(&t, i);
+        if ((t.ctrl[i] & 0x80) && e->len > HM_INLINE_KEY &&
+            fwrite(_long_key(e, t.keys), 1, e->len + 1, f) != e->len + 1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Writes the map to path, through a temporary file renamed over it at the
+ * end, so a reader never sees half a snapshot. */
+int hm_save(hashmap *hm, const char *path)
+{
+    if (hm->hasher && hm->hasher != hm_hash_wyhash && hm->hasher != hm_hash_fnv1a)
+        return -1;
+
+    size_t n = strlen(path);
+    char *tmp = _hm_malloc(_hm_alloc_of(hm), n + sizeof ".tmp");
+    if (!tmp) return -1;
+    memcpy(tmp, path, n);
+    memcpy(tmp + n, ".tmp", sizeof ".tmp");
+
+    int r = -1;
+    _hm_lock(hm);
+    if (!hm->capacity && _hm_resize(hm, 0) < 0)
+        goto out;
+    if (_hm_migrating(hm))
+        _hm_migrate(hm, hm->old_capacity / HM_GROUP_WIDTH);
+    if (!hm->seed)
+        hm->seed = _hm_random_seed(hm);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) goto out;
+    r = _snapshot_write(hm, f);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+        r = -1;
+    if (fclose(f) != 0)
+        r = -1;
+    if (r == 0 && rename(tmp, path) != 0)
+        r = -1;
+    if (r < 0)
+        remove(tmp);
+out:
+    _hm_unlock(hm);
+    _hm_free(hm->allocator, tmp, n + sizeof ".tmp");
+    return r;
+}
+
+/* Maps a snapshot read-only and sets hm up to serve lookups straight from it.
+ * The file is trusted past its header: the entries are not checked. */
+int hm_open_mmap(hashmap *hm, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(hm_snapshot_header))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const hm_snapshot_header *h = map;
+    size_t size = (size_t)st.st_size;
+    uint64_t cap = h->capacity;
+    int ok = memcmp(h->magic, HM_SNAPSHOT_MAGIC, sizeof h->magic) == 0
+          && h->version == HM_SNAPSHOT_VERSION
+          && h->byte_order == HM_SNAPSHOT_ORDER
+          && h->entry_size == sizeof(hm_entry)
+          && h->hasher <= HM_SNAPSHOT_FNV1A
+          && cap >= HM_GROUP_WIDTH && (cap & (cap - 1)) == 0
+          && cap <= (size - sizeof *h) / (sizeof(hm_entry) + 1)
+          && h->count + h->tombstones <= cap
+          && h->max_probe < cap / HM_GROUP_WIDTH
+          && h->keys_size == size - sizeof *h - cap * (sizeof(hm_entry) + 1);
+    if (!ok) {
+        munmap(map, size);
+        return -1;
+    }
+
+    uint8_t *ctrl = (uint8_t *)map + sizeof *h;
+    hm_entry *items = (hm_entry *)(ctrl + cap);
+    *hm = (hashmap){
+        .items = items,
+        .ctrl = ctrl,
+        .capacity = cap,
+        .count = h->count,
+        .tombstones = h->tombstones,
+        .max_probe = h->max_probe,
+        .hasher = h->hasher == HM_SNAPSHOT_FNV1A ? hm_hash_fnv1a : NULL,
+        .seed = h->seed,
+        .grow_at = cap,
+        .mapping = map,
+        .mapping_size = size,
+        .mapped_keys = (const char *)(items + cap),
+    };
+    return 0;
+}
+
+/* --- Frozen maps ---
+ *
+ * A minimal perfect hash, PTHash style: keys go into buckets of about
+ * HM_FROZEN_BUCKET by their hash, and each bucket gets a pilot, a number
+ * that, mixed into the hash of each of its keys, sends them all to slots no
+ * other key has. Buckets are placed biggest first, when the table is still
+ * empty and a pilot is easy to find.
+ *
+ * Pilots pick from a few more slots than there are keys: with exactly one
+ * each, the last buckets would take about n tries to hit the last free
+ * slots, and building would go quadratic. The keys that land in a spare
+ * slot past the end are moved to one of the free slots below it, through
+ * the remap array, so the table still has one slot per key and a lookup is
+ * a bucket, a pilot, one slot (and rarely a remap), one compare.
+ *
+ * Keys are rehashed with a fresh seed only when two keys in a bucket hash
+ * the same, which no pilot can separate; normally the map's own hashes are
+ * reused as they are.
+ * */
+#define HM_FROZEN_BUCKET  4         // average keys per bucket
+#define HM_FROZEN_SPARE   64        // keys per spare slot
+#define HM_FROZEN_PILOTS  (1u << 22) // tries per bucket before a reseed
+#define HM_FROZEN_SEEDS   8         // reseeds before giving up
+
+/* x scaled from [0, 2^32) to [0, n) without a division */
+#define _fastrange32(x, n) ((size_t)(((uint64_t)(uint32_t)(x) * (uint64_t)(n)) >> 32))
+
+static inline size_t _frozen_bucket(uint64_t h, size_t nbuckets)
+{
+    return _fastrange32(h, nbuckets);
+}
+
+static inline size_t _frozen_slot(uint64_t h, uint64_t pilot, size_t n)
+{
+    return _fastrange32(_wy_mix(h ^ pilot, WY_P1) >> 32, n);
+}
+
+/* the pilot is stored small and mixed before use, so nearby pilots differ */
+static inline uint64_t _frozen_pilot(uint32_t p)
+{
+    return _wy_mix(p, WY_P0);
+}
+
+static inline uint64_t _frozen_hash(const hm_frozen *f, const char *key, size_t len)
+{
+    return f->hasher ? f->hasher(key, len, f->seed) : hm_hash_wyhash(key, len, f->seed);
+}
+
+/* where the key with hash h is, once every bucket has its pilot */
+static inline size_t _frozen_index(const hm_frozen *f, uint64_t h)
+{
+    size_t b = _frozen_bucket(h, f->nbuckets);
+    size_t s = _frozen_slot(h, _frozen_pilot(f->pilots[b]), f->nslots);
+    return s < f->count ? s : f->remap[s - f->count];
+}
+
+/* one key while building: where it is in the map and its hash for f */
+typedef struct {
+    const hm_entry *e;
+    const char *key;
+    uint64_t h;
+} hm_frozen_key;
+
+/* Finds a pilot for every bucket, taken marks the slots used out of
+ * f->nslots. Returns 0, or -1 when some bucket had no pilot within
+ * HM_FROZEN_PILOTS tries or can't have one at all. */
+static int _frozen_place(hm_frozen *f, hm_frozen_key *ks, size_t n,
+                         size_t *order, size_t *start, uint64_t *taken, size_t *pos)
+{
+    size_t nb = f->nbuckets, m = f->nslots, max = 0;
+
+    /* keys sorted by bucket, counting sort: start[b] is where bucket b begins */
+    memset(start, 0, (nb + 1) * sizeof *start);
+    for (size_t i = 0; i < n; i++)
+        start[_frozen_bucket(ks[i].h, nb) + 1]++;
+    for (size_t b = 0; b < nb; b++) {
+        if (start[b + 1] > max) max = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    size_t *fill = pos;     // borrowed until the placing starts
+    memcpy(fill, start, nb * sizeof *fill);
+    for (size_t i = 0; i < n; i++)
+        order[fill[_frozen_bucket(ks[i].h, nb)]++] = i;
+
+    /* buckets biggest first, again counting sort, by size */
+    size_t *by_size = _hm_calloc(f->allocator, (max + 2) * sizeof *by_size);
+    size_t *buckets = _hm_malloc(f->allocator, nb * sizeof *buckets);
+    int r = -1;
+    if (!by_size || !buckets) goto out;
+    for (size_t b = 0; b < nb; b++)
+        by_size[max - (start[b + 1] - start[b]) + 1]++;
+    for (size_t sz = 0; sz <= max; sz++)
+        by_size[sz + 1] += by_size[sz];
+    for (size_t b = 0; b < nb; b++)
+        buckets[by_size[max - (start[b + 1] - start[b])]++] = b;
+
+    memset(taken, 0, ((m + 63) / 64) * sizeof *taken);
+    for (size_t i = 0; i < nb; i++) {
+        size_t b = buckets[i], first = start[b], size = start[b + 1] - first;
+        if (!size) break;       // the rest are empty too
+
+        /* keys with the same hash land together for every pilot */
+        for (size_t x = 0; x < size; x++)
+            for (size_t y = x + 1; y < size; y++)
+                if (ks[order[first + x]].h == ks[order[first + y]].h)
+                    goto out;
+
+        uint32_t p = 0;
+        for (;; p++) {
+            if (p == HM_FROZEN_PILOTS) goto out;
+            uint64_t pm = _frozen_pilot(p);
+            size_t k = 0;
+            for (; k < size; k++) {
+                size_t s = _frozen_slot(ks[order[first + k]].h, pm, m);
+                if (taken[s / 64] >> (s % 64) & 1)
+                    break;
+                taken[s / 64] |= 1ull << (s % 64);
+                pos[k] = s;
+            }
+            if (k == size) break;
+            while (k--)         // undo, try the next pilot
+                taken[pos[k] / 64] &= ~(1ull << (pos[k] % 64));
+        }
+        f->pilots[b] = p;
+    }
+    r = 0;
+out:
+    _hm_free(f->allocator, by_size, (max + 2) * sizeof *by_size);
+    _hm_free(f->allocator, buckets, nb * sizeof *buckets);
+    return r;
+}
+
+/* Builds an immutable map with a minimal perfect hash over hm's keys and
+ * values at the time of the call. hm is not changed, and the two have
+ * nothing in common afterwards. */
+int hm_freeze(hm_frozen *f, hashmap *hm)
+{
+    size_t n = hm->count;
+    *f = (hm_frozen){
+        .hasher = hm->hasher,
+        .seed = hm->seed,
+        .count = n,
+        .allocator = _hm_alloc_of(hm),
+    };
+    if (n >= UINT32_MAX) return -1;
+    if (!n) return 0;
+
+    const hm_allocator *a = f->allocator;
+    size_t nb = f->nbuckets = n / HM_FROZEN_BUCKET + 1;
+    size_t m = f->nslots = n + n / HM_FROZEN_SPARE + 1;
+    size_t npos = n > nb ? n : nb;
+    hm_frozen_key *ks = _hm_malloc(a, n * sizeof *ks);
+    size_t *order = _hm_malloc(a, n * sizeof *order);
+    size_t *start = _hm_malloc(a, (nb + 1) * sizeof *start);
+    size_t *pos = _hm_malloc(a, npos * sizeof *pos);
+    uint64_t *taken = _hm_malloc(a, ((m + 63) / 64) * sizeof *taken);
+    f->pilots = _hm_malloc(a, nb * sizeof *f->pilots);
+    f->remap = _hm_calloc(a, (m - n) * sizeof *f->remap);
+    f->items = _hm_calloc(a, n * sizeof *f->items);
+    int r = -1;
+    if (!ks || !order || !start || !pos || !taken || !f->pilots || !f->remap || !f->items)
+        goto fail;
+
+    /* every key, from the old table too if a resize is underway */
+    size_t k = 0, blob = 0;
+    hm_table t = _hm_table(hm), ot = _hm_old_table(hm);
+    for (int pass = 0; pass < 2; pass++) {
+        hm_table *p = pass ? &ot : &t;
+        for (size_t i = 0; i < p->capacity; i++) {
+            if (!(p->ctrl[i] & 0x80)) continue;
+            const hm_entry *e = _tbl_entry(p, i);
+            ks[k++] = (hm_frozen_key){
+                e, _hm_inline(hm, e->len) ? e->ikey : _long_key(e, p->keys), e->hash
+            };
+            if (e->len > HM_INLINE_KEY) blob += e->len + 1;
+        }
+    }
+
+    int seeds = 0;
+    while (_frozen_place(f, ks, n, order, start, taken, pos) < 0) {
+        if (++seeds == HM_FROZEN_SEEDS)
+            goto fail;
+        f->seed = _hm_random_seed(f);
+        for (size_t i = 0; i < n; i++)
+            ks[i].h = _frozen_hash(f, ks[i].key, ks[i].e->len);
+    }
+
+    /* as many keys landed past n as there are free slots below it */
+    for (size_t s = n, j = 0; s < m; s++) {
+        if (!(taken[s / 64] >> (s % 64) & 1)) continue;
+        while (taken[j / 64] >> (j % 64) & 1) j++;
+        f->remap[s - n] = (uint32_t)j++;
+    }
+
+    /* entries into their slots, long keys packed into one block */
+    f->keys_size = blob;
+    if (blob && !(f->keys = _hm_malloc(a, blob)))
+        goto fail;
+    char *kp = f->keys;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t h = ks[i].h;
+        hm_entry *e = &f->items[_frozen_index(f, h)];
+        *e = *ks[i].e;
+        e->hash = (size_t)h;
+        if (e->len > HM_INLINE_KEY) {
+            memcpy(kp, ks[i].key, e->len + 1);
+            e->key = kp;
+            kp += e->len + 1;
+        } else {
+            /* inline here even if the map kept it in the arena */
+            memset(e->ikey, 0, sizeof e->ikey);
+            memcpy(e->ikey, ks[i].key, e->len);
+        }
+    }
+
+    r = 0;
+fail:
+    _hm_free(a, ks, n * sizeof *ks);
+    _hm_free(a, order, n * sizeof *order);
+    _hm_free(a, start, (nb + 1) * sizeof *start);
+    _hm_free(a, pos, npos * sizeof *pos);
+    _hm_free(a, taken, ((m + 63) / 64) * sizeof *taken);
+    if (r < 0)
+        hm_frozen_destroy(f);
+    return r;
+}
+
+uintptr_t hm_frozen_get_n(const hm_frozen *f, const char *key, size_t len)
+{
+    if (!f->count) return 0;
+    uint64_t h = _frozen_hash(f, key, len);
+    const hm_entry *e = &f->items[_frozen_index(f, h)];
+
+    hm_key k = _hm_key(key, len, (size_t)h);
+    return e->hash == k.hash && _key_eq(e, &k, NULL) ? e->value : 0;
+}
+
+int hm_frozen_contains_key_n(const hm_frozen *f, const char *key, size_t len)
+{
+    if (!f->count) return 0;
+    uint64_t h = _frozen_hash(f, key, len);
+    const hm_entry *e = &f->items[_frozen_index(f, h)];
+
+    hm_key k = _hm_key(key, len, (size_t)h);
+    return e->hash == k.hash && _key_eq(e, &k, NULL);
+}
+
+uintptr_t hm_frozen_get(const hm_frozen *f, const char *key)
+{
+    return hm_frozen_get_n(f, key, strlen(key));
+}
+
+int hm_frozen_contains_key(const hm_frozen *f, const char *key)
+{
+    return hm_frozen_contains_key_n(f, key, strlen(key));
+}
+
+/* Every slot holds a key, so iterating is walking the array */
+int hm_frozen_next(const hm_frozen *f, size_t *it, const char **key, size_t *len, uintptr_t *value)
+{
+    if (*it >= f->count) return 0;
+    const hm_entry *e = &f->items[(*it)++];
+    if (key) *key = e->len > HM_INLINE_KEY ? e->key : e->ikey;
+    if (len) *len = e->len;
+    if (value) *value = e->value;
+    return 1;
+}
+
+void hm_frozen_destroy(hm_frozen *f)
+{
+    const hm_allocator *a = f->allocator;
+    if (a) {
+        _hm_free(a, f->items, f->count * sizeof *f->items);
+        _hm_free(a, f->pilots, f->nbuckets * sizeof *f->pilots);
+        _hm_free(a, f->remap, (f->nslots - f->count) * sizeof *f->remap);
+        _hm_free(a, f->keys, f->keys_size);
+    }
+    *f = (hm_frozen){0};
+}
+
+/* --- Integer keys ---
+ *
+ * hm_u64 is its own little table: 16-byte entries, key and value, nothing
+ * else. Key 0 marks an empty slot (so a calloc'd table is empty) and is
+ * itself kept out of the table, in the map struct. Slots are probed
+ * linearly from the top bits of a seeded multiply-mix of the key, and a
+ * remove shifts the rest of the run back, so there are no tombstones and no
+ * control bytes to keep. Without the groups of the string map, linear
+ * probing wants a lower load, 75%.
+ * */
+#define HM_U64_MAX_LOAD_NUM 3      // 3/4
+#define HM_U64_MAX_LOAD_DEN 4
+
+static inline size_t _u64_home(const hm_u64 *m, uint64_t key)
+{
+    return (size_t)(_wy_mix(key ^ m->seed, WY_P1) >> m->shift);
+}
+
+/* The slot holding key, or the empty one where it would go */
+static inline size_t _u64_slot(const hm_u64 *m, uint64_t key)
+{
+    size_t mask = m->capacity - 1;
+    size_t i = _u64_home(m, key);
+    while (m->items[i].key && m->items[i].key != key)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static int _u64_resize(hm_u64 *m, size_t cap)
+{
+    hm_u64 grown = *m;
+    grown.items = _hm_calloc(_hm_alloc_of(&grown), cap * sizeof *grown.items);
+    if (!grown.items) return -1;
+    grown.capacity = cap;
+    grown.shift = 64;
+    while ((size_t)1 << (64 - grown.shift) < cap) grown.shift--;
+    if (!grown.seed)
+        grown.seed = _hm_random_seed(m);
+
+    for (size_t i = 0; i < m->capacity; i++)
+        if (m->items[i].key)
+            grown.items[_u64_slot(&grown, m->items[i].key)] = m->items[i];
+
+    _hm_free(grown.allocator, m->items, m->capacity * sizeof *m->items);
+    *m = grown;
+    return 0;
+}
+
+/* Number of keys in the table (key 0 not counted) that makes it full */
+static inline size_t _u64_grow_at(size_t cap)
+{
+    return cap / HM_U64_MAX_LOAD_DEN * HM_U64_MAX_LOAD_NUM;
+}
+
+int hm_u64_put(hm_u64 *m, uint64_t key, uintptr_t value)
+{
+    if (!key) {
+        int had = m->has_zero;
+        m->has_zero = 1;
+        m->zero_value = value;
+        if (!had) m->count++;
+        return had;
+    }
+
+    size_t in_table = m->count - m->has_zero;
+    if (in_table + 1 > _u64_grow_at(m->capacity) &&
+        _u64_resize(m, m->capacity ? m->capacity << 1 : HM_INITIAL_CAPACITY) < 0)
+        return -1;
+
+    hm_u64_entry *e = &m->items[_u64_slot(m, key)];
+    if (e->key) {
+        e->value = value;
+        return 1;
+    }
+    *e = (hm_u64_entry){ key, value };
+    m->count++;
+    return 0;
+}
+
+uintptr_t hm_u64_get(hm_u64 *m, uint64_t key)
+{
+    if (!key) return m->has_zero ? m->zero_value : 0;
+    if (!m->capacity) return 0;
+    const hm_u64_entry *e = &m->items[_u64_slot(m, key)];
+    return e->key ? e->value : 0;
+}
+
+int hm_u64_contains_key(hm_u64 *m, uint64_t key)
+{
+    if (!key) return m->has_zero;
+    return m->capacity && m->items[_u64_slot(m, key)].key != 0;
+}
+
+/* Removes key, and moves back each key after it in the run that is allowed
+ * to be there, so the run stays unbroken */
+int hm_u64_remove(hm_u64 *m, uint64_t key)
+{
+    if (!key) {
+        int had = m->has_zero;
+        m->has_zero = 0;
+        m->count -= (size_t)had;
+        return had;
+    }
+    if (!m->capacity) return 0;
+
+    size_t mask = m->capacity - 1;
+    size_t i = _u64_slot(m, key);
+    if (!m->items[i].key) return 0;
+
+    for (size_t j = (i + 1) & mask; m->items[j].key; j = (j + 1) & mask) {
+        size_t home = _u64_home(m, m->items[j].key);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            m->items[i] = m->items[j];
+            i = j;
+        }
+    }
+    m->items[i] = (hm_u64_entry){0};
+    m->count--;
+    return 1;
+}
+
+int hm_u64_reserve(hm_u64 *m, size_t n)
+{
+    size_t cap = m->capacity ? m->capacity : HM_INITIAL_CAPACITY;
+    while (_u64_grow_at(cap) < n)
+        cap <<= 1;
+    return cap > m->capacity ? _u64_resize(m, cap) : 0;
+}
+
+void hm_u64_destroy(hm_u64 *m)
+{
+    _hm_free(m->allocator, m->items, m->capacity * sizeof *m->items);
+    *m = (hm_u64){0};
+}
+
+/* --- Sharded map ---
+ *
+ * N independent maps, each behind its own reader-writer lock and with its own
+ * arena. A key is hashed once, the top bits of the hash pick the shard (the
+ * low bits pick the slot inside it, so the two don't overlap), and the rest
+ * is the plain map through the _hashed calls. All shards share one hasher and
+ * seed so the one hash is valid in any of them.
+ *
+ * Each shard sits on its own cache lines so two threads working on different
+ * shards don't fight over the lock's line.
+ * */
+struct hm_shard {
+    _Alignas(64) pthread_rwlock_t lock;
+    hashmap hm;
+};
+
+int hm_sharded_init(hm_sharded *s, unsigned nshards, const hm_config *cfg)
+{
+    hm_config c = cfg ? *cfg : (hm_config){0};
+
+    /* rounding up past 2^31 would overflow n to 0 and never stop */
+    if (nshards > 1u << 31)
+        return -1;
+    unsigned n = 1, bits = 0;
+    while (n < nshards) { n <<= 1; bits++; }
+
+    *s = (hm_sharded){ .nshards = n, .shift = 64 - bits, .hasher = c.hasher };
+    s->seed = c.seed ? c.seed : _hm_random_seed(s);
+    c.seed = s->seed;
+    c.capacity /= n;
+
+    /* the allocator only promises malloc alignment, a shard wants a line */
+    s->allocator = _hm_alloc_of(&c);
+    s->mem_size = n * sizeof *s->shards + _Alignof(hm_shard) - 1;
+    s->mem = _hm_malloc(s->allocator, s->mem_size);
+    if (!s->mem) return -1;
+    s->shards = _hm_align_up(s->mem, _Alignof(hm_shard));
+
+    for (unsigned i = 0; i < n; i++) {
+        int ok = hm_init_ex(&s->shards[i].hm, &c) == 0;    // cleans up after itself
+        if (ok && pthread_rwlock_init(&s->shards[i].lock, NULL) != 0) {
+            hm_destroy(&s->shards[i].hm);
+            ok = 0;
+        }
+        if (!ok) {
+            s->nshards = i;
+            hm_sharded_destroy(s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Shard for a hash: the top bits. With one shard, shift is 64 which C does
+ * not allow for a shift, hence the check. */
+static inline hm_shard *_shard_for(hm_sharded *s, size_t hash)
+{
+    return &s->shards[s->nshards > 1 ? (uint64_t)hash >> s->shift : 0];
+}
+
+static inline size_t _sharded_hash(hm_sharded *s, const char *key, size_t len)
+{
+    if (s->hasher)
+        return (size_t)s->hasher(key, len, s->seed);
+    return (size_t)hm_hash_wyhash(key, len, s->seed);
+}
+
+/* Lookups normally only need the read lock, but an incremental resize moves
+ * entries on every call, lookups included, so those take the write lock */
+static inline void _shard_read_lock(hm_shard *sh)
+{
+    if (sh->hm.flags & HM_INCREMENTAL)
+        pthread_rwlock_wrlock(&sh->lock);
+    else
+        pthread_rwlock_rdlock(&sh->lock);
+}
+
+int hm_sharded_put_n(hm_sharded *s, const char *key, size_t len, uintptr_t value)
+{
+    size_t hash = _sharded_hash(s, key, len);
+    hm_shard *sh = _shard_for(s, hash);
+
+    pthread_rwlock_wrlock(&sh->lock);
+    int r = hm_put_hashed(&sh->hm, key, len, hash, value);
+    pthread_rwlock_unlock(&sh->lock);
+    return r;
+}
+
+uintptr_t hm_sharded_get_n(hm_sharded *s, const char *key, size_t len)
+{
+    size_t hash = _sharded_hash(s, key, len);
+    hm_shard *sh = _shard_for(s, hash);
+
+    _shard_read_lock(sh);
+    uintptr_t v = hm_get_hashed(&sh->hm, key, len, hash);
+    pthread_rwlock_unlock(&sh->lock);
+    return v;
+}
+
+int hm_sharded_contains_key_n(hm_sharded *s, const char *key, size_t len)
+{
+    size_t hash = _sharded_hash(s, key, len);
+    hm_shard *sh = _shard_for(s, hash);
+
+    _shard_read_lock(sh);
+    int r = hm_contains_key_hashed(&sh->hm, key, len, hash);
+    pthread_rwlock_unlock(&sh->lock);
+    return r;
+}
+
+int hm_sharded_remove_n(hm_sharded *s, const char *key, size_t len)
+{
+    size_t hash = _sharded_hash(s, key, len);
+    hm_shard *sh = _shard_for(s, hash);
+
+    pthread_rwlock_wrlock(&sh->lock);
+    int r = hm_remove_hashed(&sh->hm, key, len, hash);
+    pthread_rwlock_unlock(&sh->lock);
+    return r;
+}
+
+int hm_sharded_put(hm_sharded *s, const char *key, uintptr_t value)
+{
+    return hm_sharded_put_n(s, key, strlen(key), value);
+}
+
+uintptr_t hm_sharded_get(hm_sharded *s, const char *key)
+{
+    return hm_sharded_get_n(s, key, strlen(key));
+}
+
+int hm_sharded_contains_key(hm_sharded *s, const char *key)
+{
+    return hm_sharded_contains_key_n(s, key, strlen(key));
+}
+
+int hm_sharded_remove(hm_sharded *s, const char *key)
+{
+    return hm_sharded_remove_n(s, key, strlen(key));
+}
+
+/* Keys in all shards. Each shard is counted under its lock, but not all at
+ * the same instant, so with writers running it is only a snapshot. */
+size_t hm_sharded_count(hm_sharded *s)
+{
+    size_t n = 0;
+    for (unsigned i = 0; i < s->nshards; i++) {
+        pthread_rwlock_rdlock(&s->shards[i].lock);
+        n += s->shards[i].hm.count;
+        pthread_rwlock_unlock(&s->shards[i].lock);
+    }
+    return n;
+}
+
+/* Frees every shard. No other thread may be using the map. */
+void hm_sharded_destroy(hm_sharded *s)
+{
+    for (unsigned i = 0; i < s->nshards; i++) {
+        hm_destroy(&s->shards[i].hm);
+        pthread_rwlock_destroy(&s->shards[i].lock);
+    }
+    _hm_free(s->allocator, s->mem, s->mem_size);
+    s->mem = NULL;
+    s->shards = NULL;
+    s->nshards = 0;
 }
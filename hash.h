@@ -22,12 +22,15 @@
 #define HASHMAP_H
 /*
  *
- *      NOT THREAD-SAFE!
+ *      NOT THREAD-SAFE! (see HM_CONCURRENT and hm_sharded for that)
  *
  *
  * My implementation of a dynamic hashmap in C. Like the Python dict or the Java
- * HashMap it has key-value pairs and dynamic allocation. Uses linear-probing
- * (open addressing) with tombstones, arena allocation and dynamic resizing.
+ * HashMap it has key-value pairs and dynamic allocation. Uses open addressing
+ * with tombstones, arena allocation and dynamic resizing. The probing is done
+ * Swiss-table style: a separate array of 1-byte control tags (7 bits of hash
+ * plus empty/deleted states) is scanned 16 slots at a time, with SSE2 when the
+ * compiler has it and a scalar loop otherwise.
  *
  * Here we have keys in the form of strings and values are numbers, stored as
  * uintptr_t, which is an integer type guaranteed to be the size of a pointer.
@@ -47,26 +50,56 @@
  *          hashmap hm = { .capacity = 0 };
  *
  *      Either will set everything to 0, and this will enable the hm_put to set
- *      512 spots, which will grow by a factor of 2 with load factor of 70%,
- *      which means at 70% percent full the capacity will double. Arena starts
- *      at 4096 bytes for each chunk, adding chunks as needed.
+ *      512 spots, which will grow by a factor of 2 with load factor of 87.5%,
+ *      which means at 87.5% percent full the capacity will double. Arena starts
+ *      at 4096 bytes for the first chunk, each new chunk doubling up to 1 MiB.
+ *      See hm_init_ex and hm_reserve to start bigger or change any of this.
  *      This ensures fewer collisions and faster lookups, while at the same time
  *      not being too memory expensive.
  *
+ *    - Keys are hashed with wyhash, seeded per map with a random seed picked
+ *      the first time the map hashes a key, so collisions can't be forced
+ *      from the outside. Both can be set in the initializer, before use:
+ *
+ *          hashmap hm = { .hasher = hm_hash_fnv1a, .seed = 42 };
+ *
+ *      any function matching hm_hash_fn will do. A fixed seed gives the same
+ *      layout on every run, which is handy for tests and nothing else.
+ *
+ *    - Options go in .flags, e.g. { .flags = HM_INCREMENTAL } to spread
+ *      resizes out over the calls that follow them instead of one stall.
+ *
+ *    - Memory comes from malloc and friends, unless the map is given an
+ *      hm_allocator, { .allocator = &mine }, or one is made the default
+ *      for all maps with hm_set_default_allocator.
+ *
  *    - hm_put will return a 1 when it overwrote the same key, 0 means success.
  *      Neither will indicate a hash collision.
  *    - hm_get will return the value in the key value pair or 0 if not found.
- *      that does mean that if you store a 0 you will get your value no matter what
- *    - hm_remove returns a 1 if successful, 0 if not found
+ *      that does mean that if you store a 0 you will get your value no matter what,
+ *      hm_get_ptr below tells the two apart
+ *    - hm_remove returns a 1 if successful, 0 if not found. It only leaves a
+ *      tombstone when a probe could have passed the slot (its group of 16 is
+ *      full), and tombstones count toward the load, so under steady churn a
+ *      table that is mostly tombstones gets rebuilt at the same size rather
+ *      than letting probes run on.
  *    - hm_destroy will free everything and ensure no memory leaks
  *    - hm_contains_key will attempt to search by key, should return 1 if found
- *      and 0 if not. If not found every spot will have been checked, making this
- *      the same as a linear search.
+ *      and 0 if not. A miss stops at the first group of 16 with an empty slot,
+ *      or after max_probe groups, whichever comes first.
  *    - hm_contains_value can only use a linear search and will go through every
- *      position and return 1 if found, 0 if not.
+ *      position and return 1 if found, 0 if not. Unless the map has the
+ *      HM_VALUE_INDEX flag, then it is a single lookup.
  *
- * Internally we use linear probing and the fuller the array gets, the closer
- * to linear it will become. Therefore it is never more than 70% full.
+ * Internally we probe linearly, but a group of 16 at a time: one compare of
+ * the control bytes rules out the whole group, and an hm_entry is only read
+ * when its 7-bit tag matches (a false positive about 1 in 128). The fuller
+ * the array gets, the longer the runs of full groups. Inserts therefore place
+ * keys Robin Hood style: passing through a full group, a new key takes the
+ * slot of whichever entry there sits closest to its own home, and that entry
+ * moves on instead. Distances stay even, the map remembers the longest one
+ * (max_probe), and a lookup never goes further than that. That keeps misses
+ * cheap at 87.5% full, where plain linear probing would need to stay at 70%.
  *
  * Benchmarking on a Macbook M1 Pro gave this as the best results with the
  * accompanying test:
@@ -79,9 +112,34 @@
  *     Lookup:  200k in ~19ms (~10.5 Mops/sec)
  *     Remove:  200k in ~18ms (~11 Mops/sec)
  *
+ * (those are from before the control bytes)
+ *
+ * Worst-case insert while growing to 1M keys, with and without HM_INCREMENTAL
+ * (same machine): the stop-the-world resize to 2M slots stalls one insert for
+ * 50-100 ms, incremental tops out at 2-3 ms, with p99 going from ~0.4 to ~3 us
+ * for the inserts that move groups over.
+ *
+ * Lookups of 4M keys in random order, table 328 MiB (past the LLC):
+ * hm_get_n ~2.3 Mops/sec, hm_get_many in batches of 256 ~7.8 Mops/sec.
+ *
+ * Hashing 40-80 byte keys, wyhash against the old FNV-1a (single core of a
+ * Linux x86-64 VM, see bench_hash.c):
+ *
+ *     fnv1a:   ~18 Mkeys/sec hashed, 3.5 Mops/sec insert, 5.7 lookup
+ *     wyhash: ~106 Mkeys/sec hashed, 6.3 Mops/sec insert, 6.9 lookup
+ *
  * Which is pretty OK for a hand-rolled, simple-arena, linear-probe hash map
  * in plain C. There are better hashes out there and better ways to store strings.
  *
+ * Every entry records the length of its key. Short keys (most ids are) live
+ * inline in the entry itself, so a successful lookup never leaves the slot;
+ * only keys longer than HM_INLINE_KEY bytes go through a pointer into the arena.
+ *
+ * Removed keys are not lost to the arena: their blocks go on free lists by
+ * size and the next key of that size reuses them. For long lived maps with a
+ * lot of churn in key sizes, hm_compact copies the live keys into one new
+ * chunk and frees everything else.
+ *
  * Arena, or bump, allocator gives a piece of memory in advance that we can use
  * instead of using malloc per small piece of memory. This saved on a lot of time
  * and cleanup. Chunking (or slabs) also makes us be able to increase that during
@@ -91,19 +149,134 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/* A hash function: len bytes of key and the map's seed in, 64 bits out.
+ * Only the low bits pick a slot and 7 more go into the control byte, so all
+ * 64 should be well mixed. */
+typedef uint64_t (*hm_hash_fn)(const void *key, size_t len, uint64_t seed);
+
+/* Keys up to this many bytes are stored inline in the slot, NUL padded, and
+ * compare with two word compares. Longer keys are copied into the arena. */
+#define HM_INLINE_KEY 15
+
 typedef struct{
-    char *key;
+    union {
+        char *key;                      // arena copy when len > HM_INLINE_KEY
+        char ikey[HM_INLINE_KEY + 1];   // inline copy otherwise
+    };
+    size_t len;
     uintptr_t value;
     size_t hash;
 }hm_entry;
 
+/* Where a map's memory comes from: the table, the arena chunks, everything.
+ * size is passed to realloc (old_size) and free as well, for allocators that
+ * don't keep track themselves. alloc needs malloc's alignment, no more. */
+typedef struct{
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *p, size_t old_size, size_t size);
+    void (*free)(void *ctx, void *p, size_t size);
+    void *ctx;
+}hm_allocator;
+
+/* What the lookup and insert paths did, counted only when the library is
+ * built with -DHM_STATS_COUNTERS (always zero otherwise, and nothing is
+ * spent on them). Each count is a relaxed atomic add, so readers sharing a
+ * map (hm_sharded_get, lock-free readers of an HM_CONCURRENT map) all
+ * count, at the price of contended cache lines while profiling. Reset them
+ * by zeroing hm.counters while no one else is using the map. */
+typedef struct{
+    uint64_t finds;         // table lookups, for gets, puts, removes, contains
+    uint64_t groups;        // groups those probed
+    uint64_t tag_misses;    // entries whose tag matched but the key didn't
+    uint64_t gets;
+    uint64_t get_hits;
+    uint64_t inserts;
+    uint64_t overwrites;
+}hm_counters;
+
 typedef struct{
     void *arena;
     hm_entry *items;
     size_t capacity;
     size_t count;
+    size_t tombstones;  // DELETED slots, they count toward the load factor
+    size_t max_probe;   // longest distance, in groups, of any key from home
+    uint8_t *ctrl;      // one control byte per slot, same block as items
+    hm_hash_fn hasher;  // NULL = hm_hash_wyhash
+    uint64_t seed;      // 0 = pick a random one on first use
+    unsigned flags;     // HM_* options below, set before first use
+    float max_load;     // grow when this full, 0 = 0.875
+    size_t grow_at;     // count + tombstones that triggers the next resize
+    size_t min_capacity; // hm_init_ex/hm_reserve capacity, removes don't shrink below
+    unsigned resize_threads; // > 1: big resizes rehash on this many threads
+    const hm_allocator *allocator;  // NULL = the default, fixed on first use
+    size_t resizes;     // grows and rebuilds so far, for hm_stats
+    uint64_t resize_ns; // time spent in them
+    hm_counters counters;
+
+    /* previous table while an HM_INCREMENTAL resize is in progress */
+    hm_entry *old_items;
+    uint8_t *old_ctrl;
+    size_t old_capacity;
+    size_t old_max_probe;
+    size_t migrated;    // old slots below this have been moved over
+
+    void *sync;         // HM_CONCURRENT state: write lock, epochs, retired keys
+    void *value_index;  // HM_VALUE_INDEX: value -> number of keys mapped to it
+
+    /* set by hm_open_mmap: the snapshot the table lives in, read-only */
+    void *mapping;
+    size_t mapping_size;
+    const char *mapped_keys;
+
+    /* HM_ORDERED: items holds the entries in the order they were put and
+     * the table is index, slot -> position in items */
+    uint32_t *index;
+    size_t used;        // entries in items, removed ones (holes) included
+    size_t entries_cap;
 }hashmap;
 
+/* Resize incrementally: a resize only allocates the new table, and every
+ * put/get/remove after it moves a few groups of the old one over until it is
+ * empty. Spreads the rehash over many calls instead of one long stall, at the
+ * cost of lookups checking both tables while it lasts. */
+#define HM_INCREMENTAL (1u << 0)
+
+/* Lock-free reads: hm_get, hm_contains_key, hm_contains_value and
+ * hm_get_many can run from any number of threads without locking, alongside
+ * writers, which take a lock inside the map and so go one at a time.
+ * Resizes swap in a new table, and memory a reader might still be using is
+ * only freed once every reader has moved past it (epoch-based reclamation).
+ * Set it with hm_init_ex, or in the initializer, and share the map once
+ * hm_init_ex or the first hm_put has returned. Removed slots are not reused
+ * until the next rebuild. Can't be combined with HM_INCREMENTAL. */
+#define HM_CONCURRENT (1u << 1)
+
+/* Keep a reverse index, value -> number of keys mapped to it, up to date on
+ * every put, overwrite and remove, so hm_contains_value is O(1) instead of
+ * a scan of the whole table. Costs a lookup in the index per write and 16
+ * bytes per distinct value; without the flag nothing is allocated for it.
+ * Set before the first put. On an HM_CONCURRENT map the lookup in the index
+ * takes the writers' lock. */
+#define HM_VALUE_INDEX (1u << 2)
+
+/* Keep the entries in one dense array in insertion order, with the table
+ * only holding 32-bit positions into it: 5 bytes per slot instead of 41, so
+ * the 12-30% of slots a table keeps free cost next to nothing, a resize
+ * rebuilds the index and leaves the entries alone, and hm_next walks the
+ * entries in the order they were put, straight through memory. Lookups
+ * take one more indirection. Overwriting a key keeps its place, removing
+ * it leaves a hole that a later resize squeezes out. Up to 2^32 entries.
+ * Can't be combined with HM_INCREMENTAL or HM_CONCURRENT. */
+#define HM_ORDERED (1u << 3)
+
+/* Intern keys: every key, short ones too, is copied to the arena with its
+ * hash and length in front, and that copy stays where it is for as long as
+ * the key is in the map (the map is never compacted). hm_intern hands it
+ * out, see below. Costs 16 bytes per key, plus the arena room of the keys
+ * that would otherwise be inline. Set before the first put. */
+#define HM_INTERN (1u << 4)
+
 // Checks if the map contains a map to key, 1=yes, 0=no
 int hm_contains_key(hashmap *hm, const char *key);
 
@@ -122,5 +295,348 @@ int hm_remove(hashmap *hm, const char *key);
 // Destroy hashmap, freeing all allocated memory and arena
 void hm_destroy(hashmap *hm);
 
+/* --- Giving memory back, and keeping it ---
+ *
+ * A map shrinks by itself: when removes leave it under 1/8 of what its table
+ * can hold, the table is rebuilt for twice the keys left and the arena is
+ * compacted (not below the capacity given to hm_init_ex or hm_reserve, or
+ * 512 slots).
+ * hm_shrink_to_fit goes all the way down to the smallest table for the keys
+ * there are. hm_clear removes every key but keeps the table at its size and
+ * the arena's chunks to fill again, for a map that is refilled in bursts.
+ * Both return 0, or -1 when out of memory or on a mapped snapshot.
+ * */
+int hm_shrink_to_fit(hashmap *hm);
+int hm_clear(hashmap *hm);
+
+/* Iterates the map, in insertion order for HM_ORDERED maps and in no
+ * particular order otherwise. The map must not change while iterating (on
+ * an HM_INCREMENTAL map mid-resize, even hm_get moves entries), and on an
+ * HM_CONCURRENT map only with no writers running.
+ *
+ *     for (size_t it = 0; hm_next(&hm, &it, &key, &len, &value); ) ...
+ */
+int hm_next(hashmap *hm, size_t *it, const char **key, size_t *len, uintptr_t *value);
+
+/* --- Explicit length and precomputed hash variants ---
+ *
+ * The _n variants take len bytes of key, which may contain NULs and need no
+ * terminator, e.g. a slice of a network buffer. The _hashed variants also take
+ * the hash from hm_hash, so a key looked up in several maps is hashed once.
+ * A hash is only valid for maps with the same hasher and seed, so give those
+ * maps the same .seed up front.
+ * */
+size_t hm_hash(hashmap *hm, const char *key, size_t len);
+
+int hm_contains_key_n(hashmap *hm, const char *key, size_t len);
+int hm_put_n(hashmap *hm, const char *key, size_t len, uintptr_t value);
+uintptr_t hm_get_n(hashmap *hm, const char *key, size_t len);
+int hm_remove_n(hashmap *hm, const char *key, size_t len);
+
+int hm_contains_key_hashed(hashmap *hm, const char *key, size_t len, size_t hash);
+int hm_put_hashed(hashmap *hm, const char *key, size_t len, size_t hash, uintptr_t value);
+uintptr_t hm_get_hashed(hashmap *hm, const char *key, size_t len, size_t hash);
+int hm_remove_hashed(hashmap *hm, const char *key, size_t len, size_t hash);
+
+/* --- Value slots ---
+ *
+ * hm_get_ptr returns a pointer to the value stored for key, or NULL if the
+ * key isn't there, so a stored 0 can be told from a missing key. hm_upsert
+ * finds key or puts it in with the value 0, hashing it once, and returns the
+ * value's slot either way; *inserted (if not NULL) says which. A counting
+ * loop is then just
+ *
+ *          (*hm_upsert(&hm, word, NULL))++;
+ *
+ * (check for NULL, which means out of memory). The pointer is good until
+ * the next put, upsert, remove, reserve or compact on the map, and on an
+ * HM_INCREMENTAL map in the middle of a resize, until the next call of any
+ * kind. Both return NULL on HM_VALUE_INDEX and HM_CONCURRENT maps and mapped
+ * snapshots, where a write through the pointer would go unseen or race: use
+ * hm_get and hm_put there.
+ * */
+uintptr_t *hm_get_ptr(hashmap *hm, const char *key);
+uintptr_t *hm_upsert(hashmap *hm, const char *key, int *inserted);
+
+uintptr_t *hm_get_ptr_n(hashmap *hm, const char *key, size_t len);
+uintptr_t *hm_upsert_n(hashmap *hm, const char *key, size_t len, int *inserted);
+
+uintptr_t *hm_get_ptr_hashed(hashmap *hm, const char *key, size_t len, size_t hash);
+uintptr_t *hm_upsert_hashed(hashmap *hm, const char *key, size_t len, size_t hash, int *inserted);
+
+/* --- Interning (HM_INTERN maps) ---
+ *
+ * hm_intern returns the map's own copy of key, putting it in with the value
+ * 0 if it isn't there, so equal strings come back as the same pointer and
+ * can be compared with == instead of strcmp. The pointer is NUL-terminated
+ * and good until the key is removed, or the map cleared or destroyed.
+ * hm_get_interned and hm_put_interned take such a pointer, from this map,
+ * and skip hashing: the hash is read from in front of the key, and keys
+ * compare by address first. hm_intern returns NULL when out of memory, or
+ * if the map wasn't made with HM_INTERN.
+ *
+ *          const char *id = hm_intern(&names, tok);
+ *          if (id == kw_return) ...
+ *          hm_put_interned(&names, id, hm_get_interned(&names, id) + 1);
+ * */
+const char *hm_intern(hashmap *hm, const char *key);
+const char *hm_intern_n(hashmap *hm, const char *key, size_t len);
+size_t hm_interned_len(const char *ikey);
+uintptr_t hm_get_interned(hashmap *hm, const char *ikey);
+int hm_put_interned(hashmap *hm, const char *ikey, uintptr_t value);
+
+/* --- Batches ---
+ *
+ * Same as calling hm_get/hm_put/hm_remove for keys[0..n), but every key in a
+ * batch is hashed and its slots prefetched before any is resolved, so the
+ * cache misses of the batch overlap instead of coming one after the other.
+ * Pays off once the table no longer fits in cache. lens may be NULL for
+ * NUL-terminated keys.
+ * */
+
+// values[i] = value of keys[i], or 0. Returns the number found
+size_t hm_get_many(hashmap *hm, const char *const *keys, const size_t *lens,
+                   uintptr_t *values, size_t n);
+
+// Returns the number of new keys, (size_t)-1 if an insert failed
+size_t hm_put_many(hashmap *hm, const char *const *keys, const size_t *lens,
+                   const uintptr_t *values, size_t n);
+
+// Returns the number of keys removed
+size_t hm_remove_many(hashmap *hm, const char *const *keys, const size_t *lens, size_t n);
+
+/* --- Up front configuration ---
+ *
+ * The zero-initialized map is fine for most uses. When the final size is
+ * known, or the defaults do not fit, fill in an hm_config (zeroed fields keep
+ * their defaults) and call hm_init_ex instead, which also allocates the table
+ * and arena right away. hm_reserve grows the table once to fit n keys, so a
+ * bulk load does no rehashing on the way.
+ *
+ * With resize_threads above 1, growing a table of 64K slots or more (or
+ * rebuilding it to clear tombstones) moves the entries on that many threads,
+ * each filling, and first touching, its own ranges of the new table. Cuts
+ * the stall of a stop-the-world resize on big machines; HM_INCREMENTAL and
+ * HM_ORDERED maps resize as before, and so does shrinking.
+ * */
+typedef struct{
+    size_t capacity;        // initial slots, rounded up to a power of 2, 0 = 512
+    float max_load;         // in (0, 1), 0 = 0.875
+    size_t arena_chunk;     // first arena chunk in bytes, 0 = 4096
+    size_t arena_chunk_max; // chunks double up to this, 0 = 1 MiB,
+                            // same as arena_chunk for fixed size chunks
+    unsigned flags;         // HM_* options
+    hm_hash_fn hasher;      // NULL = hm_hash_wyhash
+    uint64_t seed;          // 0 = random
+    const hm_allocator *allocator;  // NULL = the default, must outlive the map
+    unsigned resize_threads;        // 0 = resizes run on the calling thread
+}hm_config;
+
+// Initializes hm from cfg, allocating table and arena. 0 on success, -1 else
+int hm_init_ex(hashmap *hm, const hm_config *cfg);
+
+// Makes room for n keys without any further resize. 0 on success, -1 else
+int hm_reserve(hashmap *hm, size_t n);
+
+/* Builds a map from n keys and values at once (as hm_init_ex with cfg, NULL
+ * for the defaults, and hm_put of each pair in order) on threads threads, 0
+ * = one per CPU. The keys are hashed and split by where they go in the table
+ * in parallel, then every thread fills its own ranges of it, so it scales
+ * with the threads where a loop of hm_put can't. The result is an ordinary
+ * map. lens may be NULL for NUL-terminated keys. Up to 2^32 keys, and not
+ * for HM_ORDERED maps. 0 on success, -1 else (hm is left zeroed). */
+int hm_build(hashmap *hm, const hm_config *cfg, const char *const *keys, const size_t *lens,
+             const uintptr_t *values, size_t n, unsigned threads);
+
+// Allocator for maps that don't name one, NULL = back to malloc. A map
+// keeps the one it first allocated from, so changing this leaves the maps
+// already in use alone. Not thread-safe, set it before making maps.
+void hm_set_default_allocator(const hm_allocator *a);
+
+// Moves the live keys into fresh contiguous arena memory and frees the old
+// chunks. Returns the number of bytes given back.
+size_t hm_compact(hashmap *hm);
+
+/* Snapshots: hm_save writes the table as it is, control bytes and entries,
+ * with the long keys packed into a blob after it (offsets instead of arena
+ * pointers), to a versioned file. hm_open_mmap maps such a file read-only
+ * and the map serves hm_get, hm_contains_key and friends straight from it,
+ * no rehashing, no copying, and the page cache shared between processes.
+ * hm_put on it returns -1 and hm_remove 0; hm_destroy unmaps it.
+ *
+ * Values are saved as numbers, so pointers in them mean nothing in another
+ * process. The file is for the same kind of machine (byte order and entry
+ * layout are checked), and maps with a custom hasher can't be saved.
+ * Both return 0 on success, -1 on failure. */
+int hm_save(hashmap *hm, const char *path);
+int hm_open_mmap(hashmap *hm, const char *path);
+
+/* --- Statistics, for when a map is slow and you want to know why ---
+ *
+ * hm_stats scans the map once and reports how far keys sit from home (a
+ * lookup of a key d groups from home probes d + 1 groups), how far a miss
+ * would go from each home group, the longest run of groups a miss can't
+ * stop in, tombstones, resizes and arena use. A bad hash shows up as a long
+ * tail in hit_probes and a long cluster; tombstone buildup as a load well
+ * above count / capacity and misses probing far.
+ * */
+#define HM_STATS_BUCKETS 16     // the last one holds that many groups or more
+
+typedef struct{
+    size_t count;
+    size_t capacity;
+    size_t tombstones;
+    double load;                // (count + tombstones) / capacity
+    size_t max_probe;
+    size_t table_bytes;         // table(s), and the entries of HM_ORDERED
+    size_t hit_probes[HM_STATS_BUCKETS];    // [i]: keys found in i + 1 groups
+    size_t miss_probes[HM_STATS_BUCKETS];   // [i]: home groups a miss from
+                                            // probes i + 1 groups from
+    double avg_hit_probes;      // per key
+    double avg_miss_probes;     // per home group
+    size_t longest_cluster;     // most groups in a row without an empty slot
+    size_t resizes;             // grows and same-size rebuilds
+    uint64_t resize_ns;         // total time spent in them
+    size_t arena_chunks;
+    size_t arena_bytes;         // in all chunks
+    size_t arena_live;          // holding keys of the map
+    size_t arena_free;          // on the free lists, for keys to come
+    size_t arena_wasted;        // neither: unused chunk ends, big freed blocks
+    hm_counters counters;       // see HM_STATS_COUNTERS
+}hm_statistics;
+
+void hm_stats(hashmap *hm, hm_statistics *st);
+
+/* --- Frozen maps, for maps that are built once and then only read ---
+ *
+ * hm_freeze builds an immutable copy of a map's keys and values on a minimal
+ * perfect hash: one slot per key, no empty ones, and every lookup is exactly
+ * one slot and one key compare, no probing. The source map is left as it is.
+ * Keys come back from hm_frozen_next in no particular order.
+ *
+ *     hm_frozen f;
+ *     hm_freeze(&f, &hm);
+ *     hm_frozen_get(&f, "a");
+ *     for (size_t it = 0; hm_frozen_next(&f, &it, &key, &len, &value); ) ...
+ *     hm_frozen_destroy(&f);
+ *
+ * hm_freeze returns 0, or -1 when out of memory, for 2^32 - 1 keys or more, or
+ * when the hasher gives keys the same 64-bit hash under every seed tried.
+ * Building takes time linear in the keys, around half a second per million.
+ * */
+typedef struct{
+    hm_entry *items;    // count entries, where each key goes is set by pilots
+    uint32_t *pilots;   // one per bucket of about 4 keys
+    uint32_t *remap;    // the spare slots past count, to the free ones below
+    size_t count;
+    size_t nslots;      // count and about 1.5% spare, what pilots pick from
+    size_t nbuckets;
+    char *keys;         // the long keys, in one block
+    size_t keys_size;
+    hm_hash_fn hasher;
+    uint64_t seed;
+    const hm_allocator *allocator;  // the source map's
+}hm_frozen;
+
+int hm_freeze(hm_frozen *f, hashmap *hm);
+void hm_frozen_destroy(hm_frozen *f);
+
+uintptr_t hm_frozen_get(const hm_frozen *f, const char *key);
+int hm_frozen_contains_key(const hm_frozen *f, const char *key);
+uintptr_t hm_frozen_get_n(const hm_frozen *f, const char *key, size_t len);
+int hm_frozen_contains_key_n(const hm_frozen *f, const char *key, size_t len);
+
+// Next key in f after *it (start at 0), 0 when there are no more. Any of
+// key, len and value may be NULL. Keys are NUL-terminated.
+int hm_frozen_next(const hm_frozen *f, size_t *it, const char **key, size_t *len, uintptr_t *value);
+
+/* --- Integer keys ---
+ *
+ * For keys that are numbers to begin with: no formatting them into strings,
+ * no string hashing, no arena. Entries are 16 bytes, key and value, and the
+ * hash is a seeded multiply-mix of the key. Every key is allowed, 0 included
+ * (0 marks the empty slots and is stored on the side). Zero-initialize and
+ * go, like hashmap:
+ *
+ *     hm_u64 m = {0};
+ *     hm_u64_put(&m, 42, 1);
+ *     hm_u64_get(&m, 42);
+ *     hm_u64_destroy(&m);
+ *
+ * Return values are as for the string map: put 1 = overwrite, 0 = new,
+ * -1 = out of memory; get 0 = not found; remove 1 = removed.
+ * */
+typedef struct{
+    uint64_t key;
+    uintptr_t value;
+}hm_u64_entry;
+
+typedef struct{
+    hm_u64_entry *items;    // key 0 = empty slot
+    size_t capacity;
+    size_t count;           // keys, key 0 included
+    uint64_t seed;          // 0 = pick a random one on first use
+    unsigned shift;         // 64 - log2(capacity), the hash's top bits index
+    int has_zero;           // key 0, kept out of the table
+    uintptr_t zero_value;
+    const hm_allocator *allocator;  // NULL = the default, fixed on first use
+}hm_u64;
+
+int hm_u64_put(hm_u64 *m, uint64_t key, uintptr_t value);
+uintptr_t hm_u64_get(hm_u64 *m, uint64_t key);
+int hm_u64_contains_key(hm_u64 *m, uint64_t key);
+int hm_u64_remove(hm_u64 *m, uint64_t key);
+int hm_u64_reserve(hm_u64 *m, size_t n);
+void hm_u64_destroy(hm_u64 *m);
+
+// The default hash, wyhash. Word-at-a-time and seeded.
+uint64_t hm_hash_wyhash(const void *key, size_t len, uint64_t seed);
+
+// The old default, 64-bit FNV-1a, a byte at a time. Seed is xor'ed into the basis
+uint64_t hm_hash_fnv1a(const void *key, size_t len, uint64_t seed);
+
+/* --- Sharded map, for use from many threads ---
+ *
+ * Unlike hashmap itself, hm_sharded IS thread-safe. It splits the keys over
+ * nshards (rounded up to a power of 2, at most 2^31) ordinary maps by the
+ * top bits of their hash, each with its own reader-writer lock and arena, so
+ * threads only wait on each other when they hit the same shard. Lookups
+ * share a shard, writes take it alone. cfg (may be NULL) applies to every
+ * shard, with its capacity split between them.
+ *
+ *     hm_sharded s;
+ *     hm_sharded_init(&s, 64, NULL);
+ *     hm_sharded_put(&s, "a", 1);     // from any thread
+ *     hm_sharded_destroy(&s);
+ * */
+typedef struct hm_shard hm_shard;   // a lock and a hashmap
+
+typedef struct{
+    hm_shard *shards;
+    unsigned nshards;
+    unsigned shift;         // hash >> shift is the shard
+    hm_hash_fn hasher;      // shared by all shards, like the seed
+    uint64_t seed;
+    const hm_allocator *allocator;  // cfg's, for every shard too
+    void *mem;              // shards is in here, aligned
+    size_t mem_size;
+}hm_sharded;
+
+int hm_sharded_init(hm_sharded *s, unsigned nshards, const hm_config *cfg);
+void hm_sharded_destroy(hm_sharded *s);
+
+int hm_sharded_put(hm_sharded *s, const char *key, uintptr_t value);
+uintptr_t hm_sharded_get(hm_sharded *s, const char *key);
+int hm_sharded_contains_key(hm_sharded *s, const char *key);
+int hm_sharded_remove(hm_sharded *s, const char *key);
+
+int hm_sharded_put_n(hm_sharded *s, const char *key, size_t len, uintptr_t value);
+uintptr_t hm_sharded_get_n(hm_sharded *s, const char *key, size_t len);
+int hm_sharded_contains_key_n(hm_sharded *s, const char *key, size_t len);
+int hm_sharded_remove_n(hm_sharded *s, const char *key, size_t len);
+
+// Number of keys over all shards, a snapshot while writers are running
+size_t hm_sharded_count(hm_sharded *s);
+
 
 #endif // HASHMAP_H
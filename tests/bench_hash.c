@@ -1,8 +1,10 @@
+#define _POSIX_C_SOURCE 199309L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
 #include "hash.h"
 
 static long long now_ns(void) {
@@ -11,11 +13,511 @@ static long long now_ns(void) {
     return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
 }
 
+/* --- Hash functions on 40-80 byte keys, raw and inside the map --- */
+#define HKEYS 200000
+
+static void bench_hashers(void) {
+    char (*keys)[96] = malloc(HKEYS * sizeof *keys);
+    size_t *lens = malloc(HKEYS * sizeof *lens);
+    assert(keys && lens);
+
+    for (size_t i = 0; i < HKEYS; i++) {
+        lens[i] = (size_t)snprintf(keys[i], sizeof keys[i],
+                "tenant/%zu/service/session/%0*zu", i % 97, (int)(20 + i % 41), i);
+    }
+
+    struct { const char *name; hm_hash_fn fn; } hs[] = {
+        { "fnv1a ", hm_hash_fnv1a },
+        { "wyhash", hm_hash_wyhash },
+    };
+
+    for (size_t h = 0; h < sizeof hs / sizeof hs[0]; h++) {
+        long long start, end;
+        volatile uint64_t sink = 0;
+        uint64_t acc = 0;
+
+        start = now_ns();
+        for (int rep = 0; rep < 10; rep++)
+            for (size_t i = 0; i < HKEYS; i++)
+                acc += hs[h].fn(keys[i], lens[i], 42);
+        end = now_ns();
+        sink = acc;
+        (void)sink;
+        double hash_ms = (end-start)/1e6;
+
+        hashmap hm = { .hasher = hs[h].fn };
+        start = now_ns();
+        for (size_t i = 0; i < HKEYS; i++)
+            hm_put(&hm, keys[i], i);
+        end = now_ns();
+        double ins_ms = (end-start)/1e6;
+
+        size_t hits = 0;
+        start = now_ns();
+        for (size_t i = 0; i < HKEYS; i++)
+            if (hm_get(&hm, keys[i]) == i) hits++;
+        end = now_ns();
+        double get_ms = (end-start)/1e6;
+        assert(hits == HKEYS);
+        hm_destroy(&hm);
+
+        printf("%s: hash %.1f Mkeys/sec, insert %.1f Mops/sec, lookup %.1f Mops/sec\n",
+               hs[h].name, (10 * HKEYS / (hash_ms/1000.0)) / 1e6,
+               (HKEYS / (ins_ms/1000.0)) / 1e6, (HKEYS / (get_ms/1000.0)) / 1e6);
+    }
+
+    free(keys);
+    free(lens);
+}
+
+/* --- Per-insert latency, the resizes show up in the tail --- */
+#define LKEYS (1u << 20)
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_insert_latency(const char *name, unsigned flags) {
+    long long *lat = malloc(LKEYS * sizeof *lat);
+    char buf[32];
+    assert(lat);
+
+    hashmap hm = { .flags = flags };
+    for (size_t i = 0; i < LKEYS; i++) {
+        sprintf(buf, "k%zu", i);
+        long long start = now_ns();
+        hm_put(&hm, buf, i);
+        lat[i] = now_ns() - start;
+    }
+    hm_destroy(&hm);
+
+    qsort(lat, LKEYS, sizeof *lat, cmp_ll);
+    printf("%s: p50 %lld ns, p99 %lld ns, p99.9 %lld ns, max %.2f ms\n", name,
+           lat[LKEYS / 2], lat[LKEYS / 100 * 99], lat[LKEYS / 1000 * 999],
+           lat[LKEYS - 1] / 1e6);
+    free(lat);
+}
+
+/* --- Batched lookups on a table well past the LLC, keys in random order --- */
+#define BKEYS (1u << 22)
+
+static void bench_batches(void) {
+    char (*bufs)[16] = malloc(BKEYS * sizeof *bufs);
+    const char **keys = malloc(BKEYS * sizeof *keys);
+    size_t *lens = malloc(BKEYS * sizeof *lens);
+    uintptr_t *vals = malloc(BKEYS * sizeof *vals);
+    assert(bufs && keys && lens && vals);
+
+    for (size_t i = 0; i < BKEYS; i++) {
+        sprintf(bufs[i], "k%zu", i);
+        vals[i] = i + 1;
+    }
+    /* shuffled, so neighbouring lookups land far apart */
+    srand(1);
+    for (size_t i = 0; i < BKEYS; i++) {
+        size_t j = ((size_t)rand() * RAND_MAX + (size_t)rand()) % (i + 1);
+        keys[i] = keys[j];
+        keys[j] = bufs[i];
+    }
+    for (size_t i = 0; i < BKEYS; i++)
+        lens[i] = strlen(keys[i]);
+
+    hashmap hm = {0};
+    long long start = now_ns();
+    hm_put_many(&hm, keys, lens, vals, BKEYS);
+    double put_ms = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    size_t hits = 0;
+    for (size_t i = 0; i < BKEYS; i++)
+        hits += hm_get_n(&hm, keys[i], lens[i]) != 0;
+    double one_ms = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    for (size_t b = 0; b < BKEYS; b += 256)
+        hm_get_many(&hm, keys + b, lens + b, vals + b, 256);
+    double many_ms = (now_ns() - start) / 1e6;
+    assert(hits == BKEYS);
+
+    printf("hm_put_many: %.1f Mops/sec (table %zu MiB)\n", (BKEYS / (put_ms/1000.0)) / 1e6,
+           hm.capacity * (sizeof(hm_entry) + 1) >> 20);
+    printf("hm_get_n   : %.1f Mops/sec\n", (BKEYS / (one_ms/1000.0)) / 1e6);
+    printf("hm_get_many: %.1f Mops/sec (batches of 256)\n", (BKEYS / (many_ms/1000.0)) / 1e6);
+
+    hm_destroy(&hm);
+    free(bufs);
+    free(keys);
+    free(lens);
+    free(vals);
+}
+
+/* hm_contains_value on a map of VKEYS keys: the scan against HM_VALUE_INDEX,
+ * and what keeping the index costs the inserts */
+#define VKEYS  (1u << 20)
+#define VPROBES 200
+
+static void bench_value_index(void) {
+    char buf[32];
+    for (int indexed = 0; indexed < 2; indexed++) {
+        hashmap hm = { .flags = indexed ? HM_VALUE_INDEX : 0 };
+
+        long long start = now_ns();
+        for (size_t i = 0; i < VKEYS; i++) {
+            sprintf(buf, "k%zu", i);
+            hm_put(&hm, buf, i / 4);     // four keys per value
+        }
+        double put_ms = (now_ns() - start) / 1e6;
+
+        size_t hits = 0;
+        start = now_ns();
+        for (size_t i = 0; i < VPROBES; i++)
+            hits += hm_contains_value(&hm, i % 2 ? VKEYS + i : i * 1000);  // half miss
+        double ns = (double)(now_ns() - start) / VPROBES;
+        assert(hits == VPROBES / 2);
+
+        printf("%s: insert %.1f Mops/sec, hm_contains_value %.0f ns\n",
+               indexed ? "HM_VALUE_INDEX" : "scan          ",
+               (VKEYS / (put_ms/1000.0)) / 1e6, ns);
+        hm_destroy(&hm);
+    }
+}
+
+/* Cold start: building a map of SKEYS keys with hm_put against opening a
+ * snapshot of it with hm_open_mmap */
+#define SKEYS (1u << 21)
+
+static void bench_snapshot(void) {
+    const char *path = "bench_snapshot.hm";
+    char buf[64];
+    hashmap hm = {0};
+
+    long long start = now_ns();
+    for (size_t i = 0; i < SKEYS; i++) {
+        sprintf(buf, i % 2 ? "id:%zu" : "session/user/%zu/token", i);
+        hm_put(&hm, buf, i + 1);
+    }
+    double build_ms = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    assert(hm_save(&hm, path) == 0);
+    double save_ms = (now_ns() - start) / 1e6;
+
+    hashmap snap;
+    start = now_ns();
+    assert(hm_open_mmap(&snap, path) == 0);
+    double open_ms = (now_ns() - start) / 1e6;
+
+    size_t hits = 0;
+    start = now_ns();
+    for (size_t n = 0; n < 1000; n++) {
+        size_t i = n * (SKEYS / 1000);
+        sprintf(buf, i % 2 ? "id:%zu" : "session/user/%zu/token", i);
+        hits += hm_get(&snap, buf) == i + 1;
+    }
+    double first_ms = (now_ns() - start) / 1e6;
+    assert(hits == 1000);
+
+    printf("hm_put build : %.0f ms\n", build_ms);
+    printf("hm_save      : %.0f ms (%zu MiB)\n", save_ms, snap.mapping_size >> 20);
+    printf("hm_open_mmap : %.3f ms, then %.2f ms for the first 1000 lookups\n", open_ms, first_ms);
+
+    hm_destroy(&snap);
+    hm_destroy(&hm);
+    remove(path);
+}
+
+/* hm_get against hm_frozen_get on the same FKEYS keys, looked up in random
+ * order, plus what freezing costs */
+#define FKEYS (1u << 20)
+
+static void bench_frozen(void) {
+    char (*bufs)[24] = malloc(FKEYS * sizeof *bufs);
+    size_t *order = malloc(FKEYS * sizeof *order);
+    assert(bufs && order);
+
+    hashmap hm = {0};
+    for (size_t i = 0; i < FKEYS; i++) {
+        sprintf(bufs[i], "sym_%zu", i);
+        hm_put(&hm, bufs[i], i + 1);
+        order[i] = i;
+    }
+    srand(3);
+    for (size_t i = FKEYS - 1; i > 0; i--) {
+        size_t j = ((size_t)rand() * RAND_MAX + (size_t)rand()) % (i + 1);
+        size_t tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+    }
+
+    hm_frozen f;
+    long long start = now_ns();
+    assert(hm_freeze(&f, &hm) == 0);
+    double freeze_ms = (now_ns() - start) / 1e6;
+
+    size_t hits = 0;
+    start = now_ns();
+    for (size_t i = 0; i < FKEYS; i++)
+        hits += hm_get(&hm, bufs[order[i]]) != 0;
+    double get_ms = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    for (size_t i = 0; i < FKEYS; i++)
+        hits += hm_frozen_get(&f, bufs[order[i]]) != 0;
+    double frozen_ms = (now_ns() - start) / 1e6;
+    assert(hits == 2 * FKEYS);
+
+    printf("hm_freeze    : %.0f ms\n", freeze_ms);
+    printf("hm_get       : %.1f Mops/sec (%zu MiB table)\n", (FKEYS / (get_ms/1000.0)) / 1e6,
+           hm.capacity * (sizeof(hm_entry) + 1) >> 20);
+    printf("hm_frozen_get: %.1f Mops/sec (%zu MiB table)\n", (FKEYS / (frozen_ms/1000.0)) / 1e6,
+           (f.count * sizeof(hm_entry) + f.nbuckets * sizeof *f.pilots) >> 20);
+
+    hm_frozen_destroy(&f);
+    hm_destroy(&hm);
+    free(bufs);
+    free(order);
+}
+
+/* The same UKEYS integer ids through the string map, formatted with
+ * sprintf the way main() above does it, and through hm_u64 */
+#define UKEYS (1u << 20)
+
+static void bench_u64(void) {
+    char buf[32];
+    hashmap hm = {0};
+    hm_u64 m = {0};
+    size_t hits = 0;
+
+    long long start = now_ns();
+    for (uint64_t i = 1; i <= UKEYS; i++) {
+        sprintf(buf, "%llu", (unsigned long long)(i * 2654435761u));
+        hm_put(&hm, buf, i);
+    }
+    double sput = (now_ns() - start) / 1e6;
+    start = now_ns();
+    for (uint64_t i = 1; i <= UKEYS; i++) {
+        sprintf(buf, "%llu", (unsigned long long)(i * 2654435761u));
+        hits += hm_get(&hm, buf) == i;
+    }
+    double sget = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    for (uint64_t i = 1; i <= UKEYS; i++)
+        hm_u64_put(&m, i * 2654435761u, i);
+    double uput = (now_ns() - start) / 1e6;
+    start = now_ns();
+    for (uint64_t i = 1; i <= UKEYS; i++)
+        hits += hm_u64_get(&m, i * 2654435761u) == i;
+    double uget = (now_ns() - start) / 1e6;
+    assert(hits == 2 * UKEYS);
+
+    printf("string: insert %.1f Mops/sec, lookup %.1f Mops/sec, %zu MiB\n",
+           (UKEYS / (sput/1000.0)) / 1e6, (UKEYS / (sget/1000.0)) / 1e6,
+           hm.capacity * (sizeof(hm_entry) + 1) >> 20);
+    printf("hm_u64: insert %.1f Mops/sec, lookup %.1f Mops/sec, %zu MiB\n",
+           (UKEYS / (uput/1000.0)) / 1e6, (UKEYS / (uget/1000.0)) / 1e6,
+           m.capacity * sizeof(hm_u64_entry) >> 20);
+
+    hm_destroy(&hm);
+    hm_u64_destroy(&m);
+}
+
+/* Counting CKEYS distinct words over CWORDS occurrences, the way it has to
+ * be done with hm_get + hm_put, and with hm_upsert */
+#define CKEYS  (1u << 18)
+#define CWORDS (1u << 22)
+
+static void bench_upsert(void) {
+    char (*words)[16] = malloc(CKEYS * sizeof *words);
+    uint32_t *text = malloc(CWORDS * sizeof *text);
+    assert(words && text);
+    for (size_t i = 0; i < CKEYS; i++)
+        sprintf(words[i], "w%zu", i * 7919);
+    uint64_t rng = 88172645463325252ull;
+    for (size_t i = 0; i < CWORDS; i++) {
+        rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+        text[i] = (uint32_t)(rng % CKEYS);
+    }
+
+    hashmap a = {0}, b = {0};
+    long long start = now_ns();
+    for (size_t i = 0; i < CWORDS; i++)
+        hm_put(&a, words[text[i]], hm_get(&a, words[text[i]]) + 1);
+    double two_ms = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    for (size_t i = 0; i < CWORDS; i++)
+        (*hm_upsert(&b, words[text[i]], NULL))++;
+    double one_ms = (now_ns() - start) / 1e6;
+
+    for (size_t i = 0; i < CKEYS; i++)
+        assert(hm_get(&a, words[i]) == hm_get(&b, words[i]));
+    printf("hm_get + hm_put: %.1f Mops/sec\n", (CWORDS / (two_ms/1000.0)) / 1e6);
+    printf("hm_upsert      : %.1f Mops/sec\n", (CWORDS / (one_ms/1000.0)) / 1e6);
+
+    hm_destroy(&a);
+    hm_destroy(&b);
+    free(words);
+    free(text);
+}
+
+/* OKEYS keys, plain and HM_ORDERED: memory, lookups in random order, and
+ * one pass of hm_next over all of them */
+#define OKEYS (1u << 20)
+
+static void bench_ordered(void) {
+    char (*bufs)[16] = malloc(OKEYS * sizeof *bufs);
+    uint32_t *order = malloc(OKEYS * sizeof *order);
+    assert(bufs && order);
+    for (size_t i = 0; i < OKEYS; i++) {
+        sprintf(bufs[i], "k%zu", i);
+        order[i] = (uint32_t)i;
+    }
+    srand(3);
+    for (size_t i = OKEYS - 1; i > 0; i--) {
+        size_t j = ((size_t)rand() * RAND_MAX + (size_t)rand()) % (i + 1);
+        uint32_t x = order[i]; order[i] = order[j]; order[j] = x;
+    }
+
+    const char *names[] = { "plain  ", "ordered" };
+    unsigned flags[] = { 0, HM_ORDERED };
+    for (int m = 0; m < 2; m++) {
+        hashmap hm = { .flags = flags[m] };
+        for (size_t i = 0; i < OKEYS; i++)
+            hm_put(&hm, bufs[i], i + 1);
+
+        long long start = now_ns();
+        size_t hits = 0;
+        for (size_t i = 0; i < OKEYS; i++)
+            hits += hm_get(&hm, bufs[order[i]]) != 0;
+        double get_ms = (now_ns() - start) / 1e6;
+
+        start = now_ns();
+        size_t n = 0;
+        uintptr_t sum = 0, v;
+        for (size_t it = 0; hm_next(&hm, &it, NULL, NULL, &v); n++)
+            sum += v;
+        double iter_ms = (now_ns() - start) / 1e6;
+        assert(hits == OKEYS && n == OKEYS && sum == (uintptr_t)OKEYS * (OKEYS + 1) / 2);
+
+        size_t bytes = m ? hm.capacity * (sizeof(uint32_t) + 1) + hm.entries_cap * sizeof(hm_entry)
+                         : hm.capacity * (sizeof(hm_entry) + 1);
+        printf("%s: lookup %.1f Mops/sec, iterate %.1f ms, %zu MiB\n", names[m],
+               (OKEYS / (get_ms/1000.0)) / 1e6, iter_ms, bytes >> 20);
+        hm_destroy(&hm);
+    }
+    free(bufs);
+    free(order);
+}
+
+/* Batches of BURST long keys: refilled after hm_clear against a fresh map
+ * each time, and what a burst leaves behind once 99% of it is removed */
+#define BURST  (1u << 19)
+#define BURSTS 8
+
+static void bench_bursts(void) {
+    char (*bufs)[48] = malloc(BURST * sizeof *bufs);
+    assert(bufs);
+    for (size_t i = 0; i < BURST; i++)
+        sprintf(bufs[i], "batch-job/record/%zu/payload", i);
+
+    long long start = now_ns();
+    for (int b = 0; b < BURSTS; b++) {
+        hashmap hm = {0};
+        for (size_t i = 0; i < BURST; i++)
+            hm_put(&hm, bufs[i], i + 1);
+        hm_destroy(&hm);
+    }
+    double fresh_ms = (now_ns() - start) / 1e6;
+
+    hashmap hm = {0};
+    start = now_ns();
+    for (int b = 0; b < BURSTS; b++) {
+        for (size_t i = 0; i < BURST; i++)
+            hm_put(&hm, bufs[i], i + 1);
+        hm_clear(&hm);
+    }
+    double clear_ms = (now_ns() - start) / 1e6;
+    printf("new map per burst: %.1f Mops/sec\n", (BURSTS * BURST / (fresh_ms/1000.0)) / 1e6);
+    printf("hm_clear between : %.1f Mops/sec\n", (BURSTS * BURST / (clear_ms/1000.0)) / 1e6);
+
+    hm_statistics st;
+    for (size_t i = 0; i < BURST; i++)
+        hm_put(&hm, bufs[i], i + 1);
+    hm_stats(&hm, &st);
+    size_t peak = st.table_bytes + st.arena_bytes;
+    for (size_t i = BURST / 100; i < BURST; i++)
+        hm_remove(&hm, bufs[i]);
+    hm_stats(&hm, &st);
+    printf("after removing 99%%: %zu KiB of %zu KiB at peak\n",
+           (st.table_bytes + st.arena_bytes) >> 10, peak >> 10);
+    hm_destroy(&hm);
+    free(bufs);
+}
+
+/* IKEYS identifiers, looked up IOPS times in random order: by string, and
+ * by the pointer hm_intern gave for them. Long enough for the hash to
+ * cost something, as identifiers in a parser are. */
+#define IKEYS (1u << 18)
+#define IOPS  (1u << 22)
+
+static void bench_intern(void) {
+    char (*names)[40] = malloc(IKEYS * sizeof *names);
+    const char **ids = malloc(IKEYS * sizeof *ids);
+    uint32_t *order = malloc(IOPS * sizeof *order);
+    assert(names && ids && order);
+    uint64_t rng = 88172645463325252ull;
+    for (size_t i = 0; i < IOPS; i++) {
+        rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+        order[i] = (uint32_t)(rng % IKEYS);
+    }
+
+    hashmap plain = {0}, interned = { .flags = HM_INTERN };
+    for (size_t i = 0; i < IKEYS; i++) {
+        sprintf(names[i], "module.section.identifier_%zu", i);
+        hm_put(&plain, names[i], i + 1);
+        ids[i] = hm_intern(&interned, names[i]);
+        hm_put_interned(&interned, ids[i], i + 1);
+    }
+
+    uintptr_t sum = 0;
+    long long start = now_ns();
+    for (size_t i = 0; i < IOPS; i++)
+        sum += hm_get(&plain, names[order[i]]);
+    double str_ms = (now_ns() - start) / 1e6;
+
+    uintptr_t isum = 0;
+    start = now_ns();
+    for (size_t i = 0; i < IOPS; i++)
+        isum += hm_get_interned(&interned, ids[order[i]]);
+    double ptr_ms = (now_ns() - start) / 1e6;
+    assert(sum == isum);
+
+    hm_statistics a, b;
+    hm_stats(&plain, &a);
+    hm_stats(&interned, &b);
+    printf("hm_get          : %.1f Mops/sec\n", (IOPS / (str_ms/1000.0)) / 1e6);
+    printf("hm_get_interned : %.1f Mops/sec\n", (IOPS / (ptr_ms/1000.0)) / 1e6);
+    printf("memory          : %zu KiB plain, %zu KiB interned\n",
+           (a.table_bytes + a.arena_bytes) >> 10, (b.table_bytes + b.arena_bytes) >> 10);
+
+    hm_destroy(&plain);
+    hm_destroy(&interned);
+    free(names);
+    free(ids);
+    free(order);
+}
+
 int main(void) {
     const size_t N = 200000;
-    char buf[64];
+    char (*keys)[16] = malloc(N * sizeof *keys);
+    assert(keys);
     hashmap hm = {0};
 
+    /* made up front, so the loops below time the map and not sprintf;
+     * bench_workload has the realistic mixes */
+    for (size_t i=0; i<N; i++)
+        sprintf(keys[i], "k%zu", i);
+
     // Warmup: allocate arena + bucket table
     hm_put(&hm, "warmup", 123);
     hm_remove(&hm, "warmup");
@@ -24,10 +526,8 @@ int main(void) {
 
     // INSERT
     start = now_ns();
-    for (size_t i=0; i<N; i++) {
-        sprintf(buf, "k%zu", i);    // or sprintf
-        hm_put(&hm, buf, i);
-    }
+    for (size_t i=0; i<N; i++)
+        hm_put(&hm, keys[i], i);
     end = now_ns();
     double ins_ms = (end-start)/1e6;
     printf("Insert:  %zu ops in %.2f ms = %.1f Mops/sec\n",
@@ -36,10 +536,8 @@ int main(void) {
     // LOOKUP
     size_t hits=0;
     start = now_ns();
-    for (size_t i=0; i<N; i++) {
-        sprintf(buf, "k%zu", i);
-        if (hm_get(&hm, buf) == i) hits++;
-    }
+    for (size_t i=0; i<N; i++)
+        if (hm_get(&hm, keys[i]) == i) hits++;
     end = now_ns();
     double get_ms = (end-start)/1e6;
     printf("Lookup:  %zu ops in %.2f ms = %.1f Mops/sec (%zu hits)\n",
@@ -48,16 +546,49 @@ int main(void) {
     // REMOVE
     size_t removed = 0;
     start = now_ns();
-    for (size_t i=0; i<N; i++) {
-        sprintf(buf, "k%zu", i);
-        if (hm_remove(&hm, buf))
+    for (size_t i=0; i<N; i++)
+        if (hm_remove(&hm, keys[i]))
             removed++;
-    }
     end = now_ns();
     double rm_ms = (end-start)/1e6;
     printf("Remove:  %zu ops in %.2f ms = %.1f Mops/sec (%zu removed)\n",
            N, rm_ms, (N / (rm_ms/1000.0)) / 1e6, removed);
 
     hm_destroy(&hm);
+    free(keys);
+
+    printf("\n40-80 byte keys, %d of them:\n", HKEYS);
+    bench_hashers();
+
+    printf("\nInsert latency, %u keys:\n", LKEYS);
+    bench_insert_latency("stop-the-world", 0);
+    bench_insert_latency("incremental   ", HM_INCREMENTAL);
+
+    printf("\nBatches, %u keys in random order:\n", BKEYS);
+    bench_batches();
+
+    printf("\nValue lookups, %u keys:\n", VKEYS);
+    bench_value_index();
+
+    printf("\nCold start, %u keys:\n", SKEYS);
+    bench_snapshot();
+
+    printf("\nFrozen, %u keys in random order:\n", FKEYS);
+    bench_frozen();
+
+    printf("\nInteger keys, %u of them:\n", UKEYS);
+    bench_u64();
+
+    printf("\nCounting %u words, %u distinct:\n", CWORDS, CKEYS);
+    bench_upsert();
+
+    printf("\nInsertion order, %u keys:\n", OKEYS);
+    bench_ordered();
+
+    printf("\n%d bursts of %u keys:\n", BURSTS, BURST);
+    bench_bursts();
+
+    printf("\nInterned keys, %u of them, %u lookups:\n", IKEYS, IOPS);
+    bench_intern();
     return 0;
 }
@@ -0,0 +1,220 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include "hash.h"
+
+/* Multi-threaded throughput: one hashmap behind one mutex (what you have to
+ * do with a plain hashmap) against hm_sharded and an HM_CONCURRENT map with
+ * lock-free readers, from 1 to 32 threads, for a read-only, a 95% read and
+ * a mixed read/write workload. Then building a map of BUILD_KEYS keys with
+ * hm_build on 1 to 32 threads, against a loop of hm_put, and the time of
+ * one resize of a big table with resize_threads from 1 to 32. */
+
+#define NKEYS      (1u << 20)
+#define OPS        200000       // per thread
+#define SHARDS     64
+#define MAX_THREADS 32
+#define BUILD_KEYS (1u << 22)
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static char (*keys)[16];
+static size_t lens[NKEYS];
+
+static hashmap global;
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static hm_sharded sharded;
+static hashmap lockfree;
+
+enum { GLOBAL, SHARDED, LOCKFREE };
+
+typedef struct {
+    int map;
+    int write_pct;      // share of ops that are puts or removes
+    uint64_t rng;
+    size_t hits;
+} worker;
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static void *run(void *arg) {
+    worker *w = arg;
+    for (int i = 0; i < OPS; i++) {
+        uint64_t r = xorshift(&w->rng);
+        size_t k = r % NKEYS;
+        int write = (int)((r >> 32) % 100) < w->write_pct;
+        int remove = write && (r >> 40) % 2;
+
+        if (w->map == LOCKFREE) {
+            if (!write)
+                w->hits += hm_get_n(&lockfree, keys[k], lens[k]) != 0;
+            else if (remove)
+                hm_remove_n(&lockfree, keys[k], lens[k]);
+            else
+                hm_put_n(&lockfree, keys[k], lens[k], k + 1);
+        } else if (w->map == SHARDED) {
+            if (!write)
+                w->hits += hm_sharded_get_n(&sharded, keys[k], lens[k]) != 0;
+            else if (remove)
+                hm_sharded_remove_n(&sharded, keys[k], lens[k]);
+            else
+                hm_sharded_put_n(&sharded, keys[k], lens[k], k + 1);
+        } else {
+            pthread_mutex_lock(&global_lock);
+            if (!write)
+                w->hits += hm_get_n(&global, keys[k], lens[k]) != 0;
+            else if (remove)
+                hm_remove_n(&global, keys[k], lens[k]);
+            else
+                hm_put_n(&global, keys[k], lens[k], k + 1);
+            pthread_mutex_unlock(&global_lock);
+        }
+    }
+    return NULL;
+}
+
+static double bench(int map, int write_pct, int nthreads) {
+    pthread_t th[MAX_THREADS];
+    worker ws[MAX_THREADS];
+
+    long long start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        ws[i] = (worker){ map, write_pct, 0x9e3779b97f4a7c15ull * (uint64_t)(i + 1), 0 };
+        pthread_create(&th[i], NULL, run, &ws[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(th[i], NULL);
+    double secs = (now_ns() - start) / 1e9;
+
+    return (double)OPS * nthreads / secs / 1e6;
+}
+
+/* Half the keys short and half long enough for the arena, and every 8th
+ * one a duplicate */
+static char (*bkeys)[40];
+static const char **kp;
+static size_t *kl;
+static uintptr_t *vals;
+
+static void build_keys_make(void) {
+    bkeys = malloc(BUILD_KEYS * sizeof *bkeys);
+    kp = malloc(BUILD_KEYS * sizeof *kp);
+    kl = malloc(BUILD_KEYS * sizeof *kl);
+    vals = malloc(BUILD_KEYS * sizeof *vals);
+    assert(bkeys && kp && kl && vals);
+    for (size_t i = 0; i < BUILD_KEYS; i++) {
+        size_t k = i % 8 == 7 ? i / 2 : i;
+        kl[i] = (size_t)(k % 2 ? sprintf(bkeys[i], "row:%zu", k)
+                               : sprintf(bkeys[i], "tenant/%zu/row/%zu", k % 97, k));
+        kp[i] = bkeys[i];
+        vals[i] = i + 1;
+    }
+}
+
+/* A fresh map per run */
+static void bench_build(void) {
+
+    printf("building a map of %u keys, Mkeys/sec:\n", BUILD_KEYS);
+    hashmap hm = { 0 };
+    long long start = now_ns();
+    for (size_t i = 0; i < BUILD_KEYS; i++)
+        hm_put_n(&hm, kp[i], kl[i], vals[i]);
+    double base = BUILD_KEYS / ((now_ns() - start) / 1e9) / 1e6;
+    size_t count = hm.count;
+    hm_destroy(&hm);
+    printf("hm_put loop        %9.1f\n", base);
+
+    printf("threads   hm_build   speedup\n");
+    for (unsigned t = 1; t <= MAX_THREADS; t *= 2) {
+        start = now_ns();
+        assert(hm_build(&hm, NULL, kp, kl, vals, BUILD_KEYS, t) == 0);
+        double mk = BUILD_KEYS / ((now_ns() - start) / 1e9) / 1e6;
+        assert(hm.count == count);
+        hm_destroy(&hm);
+        printf("%7u   %8.1f   %6.2fx\n", t, mk, mk / base);
+    }
+    printf("\n");
+}
+
+/* One stop-the-world resize: a map filled to just below its grow point, and
+ * the put that doubles it, rehashed on resize_threads threads */
+static void bench_resize(void) {
+    const size_t cap = BUILD_KEYS;
+    printf("resize of a full %zu-slot table to %zu slots, ms:\n", cap, cap * 2);
+    printf("threads   resize\n");
+    for (unsigned t = 1; t <= MAX_THREADS; t *= 2) {
+        hashmap hm;
+        assert(hm_init_ex(&hm, &(hm_config){ .capacity = cap, .resize_threads = t }) == 0);
+        size_t i = 0;
+        while (hm.count < hm.grow_at && i < BUILD_KEYS) {
+            hm_put_n(&hm, kp[i], kl[i], vals[i]);
+            i++;
+        }
+        hm_statistics st;
+        hm_stats(&hm, &st);
+        uint64_t before = st.resize_ns;
+        hm_put(&hm, "one more", 1);
+        hm_stats(&hm, &st);
+        assert(hm.capacity == cap * 2 && st.resizes == 1);
+        printf("%7u   %6.1f\n", t, (st.resize_ns - before) / 1e6);
+        hm_destroy(&hm);
+    }
+    printf("\n");
+}
+
+int main(void) {
+    keys = malloc(NKEYS * sizeof *keys);
+    assert(keys);
+
+    assert(hm_sharded_init(&sharded, SHARDS, &(hm_config){ .capacity = NKEYS * 2 }) == 0);
+    assert(hm_reserve(&global, NKEYS) == 0);
+    assert(hm_init_ex(&lockfree, &(hm_config){ .capacity = NKEYS * 2, .flags = HM_CONCURRENT }) == 0);
+    for (size_t i = 0; i < NKEYS; i++) {
+        lens[i] = (size_t)sprintf(keys[i], "key:%zu", i);
+        hm_put_n(&global, keys[i], lens[i], i + 1);
+        hm_sharded_put_n(&sharded, keys[i], lens[i], i + 1);
+        hm_put_n(&lockfree, keys[i], lens[i], i + 1);
+    }
+
+    const int pcts[] = { 0, 5, 20 };
+    for (size_t p = 0; p < sizeof pcts / sizeof pcts[0]; p++) {
+        printf("%d%% get / %d%% put+remove, Mops/sec over all threads:\n",
+               100 - pcts[p], pcts[p]);
+        printf("threads   one mutex   sharded(%d)   lock-free reads\n", SHARDS);
+        for (int t = 1; t <= MAX_THREADS; t *= 2) {
+            double g = bench(GLOBAL, pcts[p], t);
+            double s = bench(SHARDED, pcts[p], t);
+            double l = bench(LOCKFREE, pcts[p], t);
+            printf("%7d   %9.1f   %11.1f   %15.1f\n", t, g, s, l);
+        }
+        printf("\n");
+    }
+
+    build_keys_make();
+    bench_build();
+    bench_resize();
+    free(bkeys);
+    free(kp);
+    free(kl);
+    free(vals);
+
+    hm_destroy(&global);
+    hm_sharded_destroy(&sharded);
+    hm_destroy(&lockfree);
+    free(keys);
+    return 0;
+}
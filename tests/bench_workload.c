@@ -0,0 +1,320 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "hash.h"
+
+/* Workloads closer to real traffic than bench_hash.c: keys and the op
+ * sequence are generated before the clock starts, every op is timed on its
+ * own, and a run is one map configuration x key distribution x table size,
+ * with every workload mix played against it.
+ *
+ *   ./bench_workload [-n max_keys] [-o ops] [-b build] > results.csv
+ *
+ * One CSV row per run and workload goes to stdout, a readable table to
+ * stderr. -b puts a label in the build column, so the output of two builds
+ * can be concatenated and compared. Each run is forked off on its own, so
+ * peak_rss_mb is that of the run alone: its keys, op sequence and map.
+ *
+ * Latencies include one clock_gettime, whose cost is printed first. */
+
+#define MAX_KEYS    (1u << 22)
+#define OPS         (1u << 20)
+#define LAT_BUCKETS (1u << 16)  // 1 ns each, anything slower goes on a list
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* --- What is run --- */
+
+typedef struct {
+    const char *name;
+    hm_config cfg;
+} config;
+
+static const config configs[] = {
+    { "default",     { 0 } },
+    { "incremental", { .flags = HM_INCREMENTAL } },
+    { "fnv1a",       { .hasher = hm_hash_fnv1a } },
+    { "ordered",     { .flags = HM_ORDERED } },
+};
+
+/* from one that fits in L1 to one well past the last level cache */
+static const size_t sizes[] = { 1u << 10, 1u << 15, 1u << 20, 1u << 22 };
+
+enum { UNIFORM, ZIPF, LONG };
+static const char *dists[] = { "uniform", "zipf", "long" };
+
+enum { GET, PUT, REMOVE };
+
+typedef struct {
+    const char *name;
+    int get, put;       // percent of ops, removes are the rest
+    int hit;            // percent of ops on keys that were put at the start
+} workload;
+
+/* in this order: the reads leave the map as it was built */
+static const workload workloads[] = {
+    { "get-hit",     100,  0, 100 },
+    { "get-50",      100,  0,  50 },
+    { "get-miss",    100,  0,   0 },
+    { "read-mostly",  95,  4,  90 },
+    { "write-heavy",  50, 30,  90 },
+};
+
+/* --- Keys ---
+ *
+ * 2n distinct keys, the first n are put before the workloads run and the
+ * other n are the misses. Short keys stay inline (up to 15 bytes), long ones
+ * are 40 to 100 bytes and go to the arena. */
+typedef struct {
+    char *blob;
+    size_t *off;
+    size_t *len;
+    size_t n;
+} keyset;
+
+static void keys_make(keyset *ks, size_t n, int dist) {
+    size_t room = dist == LONG ? 104 : 16;
+    ks->blob = malloc(2 * n * room);
+    ks->off = malloc(2 * n * sizeof *ks->off);
+    ks->len = malloc(2 * n * sizeof *ks->len);
+    ks->n = n;
+    assert(ks->blob && ks->off && ks->len);
+
+    size_t pos = 0;
+    for (size_t i = 0; i < 2 * n; i++) {
+        /* odd multiplier mod 2^48: distinct, and nowhere near sequential */
+        unsigned long long id = (i * 0x9e3779b97f4bull) & 0xffffffffffffull;
+        int len;
+        if (dist == LONG)
+            len = snprintf(ks->blob + pos, room, "tenant/%llu/service/checkout/session/%0*llx",
+                           id % 97, (int)(8 + id % 56), id);
+        else
+            len = snprintf(ks->blob + pos, room, "u:%012llx", id);
+        ks->off[i] = pos;
+        ks->len[i] = (size_t)len;
+        pos += (size_t)len + 1;
+    }
+}
+
+static void keys_free(keyset *ks) {
+    free(ks->blob);
+    free(ks->off);
+    free(ks->len);
+}
+
+/* Zipfian ranks in [0, n) with theta 0.99, as YCSB draws them (Gray et al.,
+ * "Quickly generating billion-record synthetic databases") */
+typedef struct {
+    size_t n;
+    double theta, alpha, zetan, eta;
+} zipf;
+
+static void zipf_init(zipf *z, size_t n) {
+    z->n = n;
+    z->theta = 0.99;
+    z->zetan = 0;
+    for (size_t i = 1; i <= n; i++)
+        z->zetan += 1.0 / pow((double)i, z->theta);
+    double zeta2 = 1.0 + 1.0 / pow(2.0, z->theta);
+    z->alpha = 1.0 / (1.0 - z->theta);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - z->theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static size_t zipf_next(const zipf *z, uint64_t *rng) {
+    double u = (double)(xorshift(rng) >> 11) / 9007199254740992.0;
+    double uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, z->theta)) return 1;
+    size_t r = (size_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return r < z->n ? r : z->n - 1;
+}
+
+/* --- Ops --- */
+
+typedef struct {
+    uint32_t key;
+    uint32_t op;
+} op;
+
+static void ops_make(op *ops, size_t nops, const workload *w, size_t n,
+                     int dist, const zipf *z, uint64_t seed) {
+    uint64_t rng = seed;
+    for (size_t i = 0; i < nops; i++) {
+        uint64_t r = xorshift(&rng);
+        int pct = (int)(r % 100);
+        ops[i].op = pct < w->get ? GET : pct < w->get + w->put ? PUT : REMOVE;
+
+        /* hot keys are scattered over the table rather than next to each
+         * other: n is a power of two, so the odd multiplier is a bijection */
+        size_t k = dist == ZIPF ? (zipf_next(z, &rng) * 0x9e3779b1u) & (n - 1)
+                                : (size_t)(xorshift(&rng) % n);
+        int hit = (int)((r >> 32) % 100) < w->hit;
+        ops[i].key = (uint32_t)(hit ? k : n + k);
+    }
+}
+
+/* --- Latency --- */
+
+typedef struct {
+    uint32_t *hist;     // LAT_BUCKETS counts
+    long long *slow;    // the ones past it
+    size_t nslow;
+    size_t n;
+} latencies;
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* the q-quantile, q in [0, 1) */
+static long long lat_quantile(const latencies *l, double q) {
+    size_t rank = (size_t)(q * (double)l->n);
+    size_t seen = 0;
+    for (size_t i = 0; i < LAT_BUCKETS; i++) {
+        seen += l->hist[i];
+        if (seen > rank)
+            return (long long)i;
+    }
+    return l->slow[rank - seen];
+}
+
+static long long clock_cost(void) {
+    long long best = 1LL << 40;
+    for (int i = 0; i < 1000; i++) {
+        long long a = now_ns(), b = now_ns();
+        if (b - a < best) best = b - a;
+    }
+    return best;
+}
+
+/* --- A run: one config, distribution and size, all workloads --- */
+
+static void run(const char *build, const config *c, int dist, size_t n, size_t nops) {
+    keyset ks;
+    keys_make(&ks, n, dist);
+    zipf z = { 0 };
+    if (dist == ZIPF)
+        zipf_init(&z, n);
+    op *ops = malloc(nops * sizeof *ops);
+    latencies l = { calloc(LAT_BUCKETS, sizeof *l.hist), malloc(nops * sizeof *l.slow), 0, 0 };
+    assert(ops && l.hist && l.slow);
+
+    hashmap hm;
+    hm_config cfg = c->cfg;
+    assert(hm_init_ex(&hm, &cfg) == 0);
+    for (size_t i = 0; i < n; i++)
+        hm_put_n(&hm, ks.blob + ks.off[i], ks.len[i], i + 1);
+
+    for (size_t w = 0; w < sizeof workloads / sizeof workloads[0]; w++) {
+        ops_make(ops, nops, &workloads[w], n, dist, &z, 0x9e3779b97f4a7c15ull + w);
+        memset(l.hist, 0, LAT_BUCKETS * sizeof *l.hist);
+        l.nslow = 0;
+        l.n = nops;
+
+        size_t gets = 0, hits = 0;
+        long long total = 0, max = 0, start = now_ns();
+        for (size_t i = 0; i < nops; i++) {
+            const char *key = ks.blob + ks.off[ops[i].key];
+            size_t len = ks.len[ops[i].key];
+
+            long long t0 = now_ns();
+            if (ops[i].op == GET)
+                hits += hm_get_n(&hm, key, len) != 0;
+            else if (ops[i].op == PUT)
+                hm_put_n(&hm, key, len, ops[i].key + 1);
+            else
+                hm_remove_n(&hm, key, len);
+            long long d = now_ns() - t0;
+
+            gets += ops[i].op == GET;
+            total += d;
+            if (d > max) max = d;
+            if (d < LAT_BUCKETS) l.hist[d]++;
+            else l.slow[l.nslow++] = d;
+        }
+        double secs = (now_ns() - start) / 1e9;
+        qsort(l.slow, l.nslow, sizeof *l.slow, cmp_ll);
+
+        hm_statistics st;
+        hm_stats(&hm, &st);
+        double map_mb = (double)(st.table_bytes + st.arena_bytes) / (1 << 20);
+
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        double rss_mb = ru.ru_maxrss / 1024.0;
+
+        long long p50 = lat_quantile(&l, 0.5), p99 = lat_quantile(&l, 0.99);
+        long long p999 = lat_quantile(&l, 0.999);
+        double hit_rate = gets ? (double)hits / (double)gets : 0;
+
+        printf("%s,%s,%s,%zu,%s,%zu,%.2f,%.1f,%lld,%lld,%lld,%lld,%.3f,%.1f,%.1f\n",
+               build, c->name, dists[dist], n, workloads[w].name, nops, nops / secs / 1e6,
+               (double)total / (double)nops, p50, p99, p999, max, hit_rate, map_mb, rss_mb);
+        fprintf(stderr, "%-11s %-7s %8zu  %-11s %7.2f  %6lld %6lld %7lld  %5.2f %8.1f %8.1f\n",
+                c->name, dists[dist], n, workloads[w].name, nops / secs / 1e6,
+                p50, p99, p999, hit_rate, map_mb, rss_mb);
+    }
+
+    hm_destroy(&hm);
+    keys_free(&ks);
+    free(ops);
+    free(l.hist);
+    free(l.slow);
+}
+
+int main(int argc, char **argv) {
+    size_t max_keys = MAX_KEYS, nops = OPS;
+    const char *build = "local";
+    int c;
+    while ((c = getopt(argc, argv, "n:o:b:")) != -1) {
+        if (c == 'n') max_keys = strtoull(optarg, NULL, 0);
+        else if (c == 'o') nops = strtoull(optarg, NULL, 0);
+        else if (c == 'b') build = optarg;
+        else {
+            fprintf(stderr, "usage: %s [-n max_keys] [-o ops] [-b build]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    fprintf(stderr, "clock_gettime: %lld ns, counted in every latency\n\n", clock_cost());
+    fprintf(stderr, "config      dist        keys  workload      Mops     p50    p99   p99.9   hits   map MB   rss MB\n");
+    printf("build,config,dist,keys,workload,ops,mops,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,"
+           "hit_rate,map_mb,peak_rss_mb\n");
+    fflush(stdout);
+
+    for (size_t ci = 0; ci < sizeof configs / sizeof configs[0]; ci++)
+        for (int d = 0; d < 3; d++)
+            for (size_t s = 0; s < sizeof sizes / sizeof sizes[0] && sizes[s] <= max_keys; s++) {
+                pid_t pid = fork();
+                assert(pid >= 0);
+                if (pid == 0) {
+                    run(build, &configs[ci], d, sizes[s], nops);
+                    fflush(stdout);
+                    _exit(0);
+                }
+                int status;
+                waitpid(pid, &status, 0);
+                assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            }
+    return 0;
+}
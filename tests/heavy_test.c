@@ -1,5 +1,7 @@
 // heavy_test.c
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +39,234 @@ static int rand_nonzero(void) {
     return v;
 }
 
+/* Steady churn: a sliding window of live keys, one insert and one remove per
+ * step. Without tombstone cleanup the probe chains only grow, so misses get
+ * slower every round; here the table must stay the same size and the misses
+ * the same speed. */
+#define CHURN_LIVE   100000
+#define CHURN_ROUNDS 20
+#define CHURN_MISSES 100000
+
+static void churn_test(void) {
+    hashmap hm = (hashmap){0};
+    char keybuf[KEYLEN];
+
+    for (int i = 0; i < CHURN_LIVE; i++) {
+        make_key(keybuf, sizeof keybuf, i);
+        ASSERT(hm_put(&hm, keybuf, (uintptr_t)i + 1) == 0);
+    }
+    size_t cap = hm.capacity;
+
+    int next = CHURN_LIVE;
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CHURN_LIVE; i++, next++) {
+            make_key(keybuf, sizeof keybuf, next);
+            ASSERT(hm_put(&hm, keybuf, (uintptr_t)next + 1) == 0);
+            make_key(keybuf, sizeof keybuf, next - CHURN_LIVE);
+            ASSERT(hm_remove(&hm, keybuf) == 1);
+        }
+        ASSERT(hm.count == CHURN_LIVE);
+        ASSERT((hm.count + hm.tombstones) * 8 <= hm.capacity * 7 + 8);
+        ASSERT(hm.capacity <= cap * 2);
+
+        clock_t start = clock();
+        for (int i = 0; i < CHURN_MISSES; i++) {
+            snprintf(keybuf, sizeof keybuf, "miss%d", i);
+            ASSERT(hm_contains_key(&hm, keybuf) == 0);
+        }
+        double ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / CHURN_MISSES;
+
+        if (round % 5 == 4)
+            printf("churn round %2d: capacity %zu, tombstones %zu, max probe %zu, %.0f ns per miss\n",
+                   round + 1, hm.capacity, hm.tombstones, hm.max_probe, ns);
+    }
+
+    hm_destroy(&hm);
+}
+
+/* Threads hammering one hm_sharded, each on its own range of keys so every
+ * thread can check its own results exactly, while all of them share shards. */
+#define MT_THREADS 8
+#define MT_KEYS    20000
+#define MT_OPS     200000
+
+static hm_sharded mt_map;
+
+static void *mt_worker(void *arg) {
+    int base = (int)(intptr_t)arg * MT_KEYS;
+    unsigned seed = (unsigned)base + 1;
+    char *live = calloc(MT_KEYS, 1);
+    char keybuf[KEYLEN];
+    ASSERT(live);
+
+    for (int op = 0; op < MT_OPS; op++) {
+        seed = seed * 1103515245u + 12345u;
+        int id = (int)((seed >> 8) % MT_KEYS);
+        make_key(keybuf, sizeof keybuf, base + id);
+
+        switch ((seed >> 4) % 3) {
+        case 0:
+            ASSERT(hm_sharded_put(&mt_map, keybuf, (uintptr_t)(base + id) + 1) == live[id]);
+            live[id] = 1;
+            break;
+        case 1:
+            ASSERT(hm_sharded_get(&mt_map, keybuf) ==
+                   (live[id] ? (uintptr_t)(base + id) + 1 : 0));
+            break;
+        default:
+            ASSERT(hm_sharded_remove(&mt_map, keybuf) == live[id]);
+            live[id] = 0;
+        }
+    }
+
+    size_t n = 0;
+    for (int i = 0; i < MT_KEYS; i++) n += live[i];
+    free(live);
+    return (void *)n;
+}
+
+static void sharded_test(void) {
+    pthread_t th[MT_THREADS];
+    size_t total = 0;
+
+    ASSERT(hm_sharded_init(&mt_map, 16, NULL) == 0);
+    for (intptr_t i = 0; i < MT_THREADS; i++)
+        ASSERT(pthread_create(&th[i], NULL, mt_worker, (void *)i) == 0);
+    for (int i = 0; i < MT_THREADS; i++) {
+        void *n;
+        pthread_join(th[i], &n);
+        total += (size_t)n;
+    }
+    ASSERT(hm_sharded_count(&mt_map) == total);
+    hm_sharded_destroy(&mt_map);
+}
+
+/* Readers on an HM_CONCURRENT map without any locking, while a writer churns
+ * other keys through it hard enough to grow it, rebuild it and compact it.
+ * The stable keys must always be there with one of their two values. */
+#define CC_READERS 4
+#define CC_STABLE  5000
+#define CC_CHURN   100000
+#define CC_ROUNDS  6
+
+static hashmap cc_map;
+static atomic_int cc_done;
+
+static void cc_key(char *buf, size_t n, int id) {
+    snprintf(buf, n, id % 2 ? "s%d" : "stable/with/a/longer/key/%d", id);
+}
+
+static void *cc_reader(void *arg) {
+    (void)arg;
+    char keybuf[KEYLEN];
+    size_t reads = 0;
+    while (!atomic_load(&cc_done)) {
+        for (int id = 0; id < CC_STABLE; id++) {
+            cc_key(keybuf, sizeof keybuf, id);
+            uintptr_t v = hm_get(&cc_map, keybuf);
+            ASSERT(v == (uintptr_t)id + 1 || v == (uintptr_t)id + 1 + CC_STABLE);
+        }
+        reads += CC_STABLE;
+    }
+    return (void *)reads;
+}
+
+/* Same, in batches through hm_get_many */
+static void *cc_batch_reader(void *arg) {
+    (void)arg;
+    enum { BATCH = 100 };
+    char bufs[BATCH][KEYLEN];
+    const char *keys[BATCH];
+    uintptr_t values[BATCH];
+    size_t reads = 0;
+    while (!atomic_load(&cc_done)) {
+        for (int id = 0; id < CC_STABLE; id += BATCH) {
+            for (int i = 0; i < BATCH; i++) {
+                cc_key(bufs[i], KEYLEN, id + i);
+                keys[i] = bufs[i];
+            }
+            ASSERT(hm_get_many(&cc_map, keys, NULL, values, BATCH) == BATCH);
+            for (int i = 0; i < BATCH; i++)
+                ASSERT(values[i] == (uintptr_t)(id + i) + 1 ||
+                       values[i] == (uintptr_t)(id + i) + 1 + CC_STABLE);
+        }
+        reads += CC_STABLE;
+    }
+    return (void *)reads;
+}
+
+static void concurrent_test(void) {
+    pthread_t th[CC_READERS];
+    char keybuf[KEYLEN];
+
+    ASSERT(hm_init_ex(&cc_map, &(hm_config){ .flags = HM_CONCURRENT }) == 0);
+    for (int id = 0; id < CC_STABLE; id++) {
+        cc_key(keybuf, sizeof keybuf, id);
+        ASSERT(hm_put(&cc_map, keybuf, (uintptr_t)id + 1) == 0);
+    }
+    for (int i = 0; i < CC_READERS; i++)
+        ASSERT(pthread_create(&th[i], NULL, i % 2 ? cc_batch_reader : cc_reader, NULL) == 0);
+
+    for (int round = 0; round < CC_ROUNDS; round++) {
+        for (int id = 0; id < CC_CHURN; id++) {
+            make_key(keybuf, sizeof keybuf, id);
+            ASSERT(hm_put(&cc_map, keybuf, (uintptr_t)id + 1) == 0);
+        }
+        for (int id = 0; id < CC_STABLE; id++) {
+            cc_key(keybuf, sizeof keybuf, id);
+            hm_put(&cc_map, keybuf, (uintptr_t)id + 1 + (round % 2 ? 0 : CC_STABLE));
+        }
+        for (int id = 0; id < CC_CHURN; id++) {
+            make_key(keybuf, sizeof keybuf, id);
+            ASSERT(hm_remove(&cc_map, keybuf) == 1);
+        }
+        if (round % 2)
+            hm_compact(&cc_map);
+    }
+    atomic_store(&cc_done, 1);
+
+    size_t reads = 0;
+    for (int i = 0; i < CC_READERS; i++) {
+        void *n;
+        pthread_join(th[i], &n);
+        reads += (size_t)n;
+    }
+    ASSERT(cc_map.count == CC_STABLE);
+    printf("concurrent: %zu lock-free reads during %d churn rounds, capacity %zu\n",
+           reads, CC_ROUNDS, cc_map.capacity);
+    hm_destroy(&cc_map);
+}
+
+/* A frozen copy of a map with millions of keys: building it has to stay
+ * linear, the last buckets must not hunt for the last free slots, and every
+ * key must come back from its one slot. */
+#define FROZEN_KEYS 4000000
+
+static void frozen_test(void) {
+    hashmap hm = (hashmap){0};
+    char keybuf[KEYLEN];
+
+    ASSERT(hm_reserve(&hm, FROZEN_KEYS) == 0);
+    for (int id = 0; id < FROZEN_KEYS; id++) {
+        snprintf(keybuf, sizeof keybuf, "%d", id);
+        ASSERT(hm_put(&hm, keybuf, (uintptr_t)id + 1) == 0);
+    }
+
+    hm_frozen f;
+    clock_t start = clock();
+    ASSERT(hm_freeze(&f, &hm) == 0);
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    for (int id = 0; id < FROZEN_KEYS; id++) {
+        snprintf(keybuf, sizeof keybuf, "%d", id);
+        ASSERT(hm_frozen_get(&f, keybuf) == (uintptr_t)id + 1);
+    }
+    ASSERT(hm_frozen_get(&f, "-1") == 0);
+    printf("frozen: %d keys in %.2f s\n", FROZEN_KEYS, secs);
+
+    hm_frozen_destroy(&f);
+    hm_destroy(&hm);
+}
+
 int main(void) {
     srand((unsigned)time(NULL));
 
@@ -154,6 +384,11 @@ int main(void) {
     free(sh);
     hm_destroy(&hm);
 
+    churn_test();
+    sharded_test();
+    concurrent_test();
+    frozen_test();
+
     printf("ALL HEAVY TESTS PASSED\n");
     return 0;
 }
@@ -120,6 +120,646 @@ static void test_contains_value(void) {
     hm_destroy(&hm);
 }
 
+/* value scan skips removed slots, and sees keys across resizes */
+static void test_contains_value_after_remove(void) {
+    hashmap hm = (hashmap){0};
+    char key[32];
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "k%d", i);
+        hm_put(&hm, key, (uintptr_t)i + 1);
+    }
+    assert(hm_contains_value(&hm, 1000) == 1);
+
+    assert(hm_remove(&hm, "k999") == 1);
+    assert(hm_contains_value(&hm, 1000) == 0);
+    assert(hm_contains_value(&hm, 1) == 1);
+
+    hm_destroy(&hm);
+}
+
+/* keys around the inline limit, and keys that are prefixes of each other */
+static void test_key_lengths(void) {
+    hashmap hm = (hashmap){0};
+    char key[64];
+
+    for (size_t n = 1; n < sizeof key; n++) {
+        memset(key, 'x', n);
+        key[n] = '\0';
+        assert(hm_put(&hm, key, n) == 0);
+    }
+    for (size_t n = 1; n < sizeof key; n++) {
+        memset(key, 'x', n);
+        key[n] = '\0';
+        assert(hm_get(&hm, key) == n);
+    }
+    assert(hm.count == sizeof key - 1);
+
+    /* 15 bytes is inline, 16 goes to the arena */
+    assert(hm_put(&hm, "123456789012345", 15) == 0);
+    assert(hm_put(&hm, "1234567890123456", 16) == 0);
+    assert(hm_get(&hm, "123456789012345") == 15);
+    assert(hm_get(&hm, "1234567890123456") == 16);
+    assert(hm_remove(&hm, "1234567890123456") == 1);
+    assert(hm_get(&hm, "123456789012345") == 15);
+    assert(hm_contains_key(&hm, "1234567890123456") == 0);
+
+    hm_destroy(&hm);
+}
+
+/* every key in the same group: probing has to walk the full groups */
+static uint64_t constant_hash(const void *key, size_t len, uint64_t seed) {
+    (void)key; (void)len; (void)seed;
+    return 7;
+}
+
+static void test_custom_hasher(void) {
+    hashmap hm = { .hasher = constant_hash };
+    char key[32];
+
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i) == 0);
+    }
+    for (uintptr_t i = 0; i < 100; i++) {
+        sprintf(key, "k%lu", i);
+        assert(hm_get(&hm, key) == i);
+    }
+    assert(hm.max_probe == 100 / 16);      // 7 groups in a row from one home
+    assert(hm_remove(&hm, "k3") == 1);
+    assert(hm_contains_key(&hm, "k3") == 0);
+    assert(hm_get(&hm, "k99") == 99);
+
+    hm_destroy(&hm);
+}
+
+/* Robin Hood: a key far from home takes the slot of one at home */
+static uint64_t two_homes_hash(const void *key, size_t len, uint64_t seed) {
+    (void)seed;
+    /* "a..." keys live in group 0, "b..." keys in group 1 */
+    return ((const char *)key)[0] == 'a' || len == 0 ? 0 : 16u << 7;
+}
+
+static void test_robin_hood(void) {
+    hashmap hm = { .hasher = two_homes_hash };
+    char key[32];
+
+    /* group 1 fills up with its own keys first */
+    for (int i = 0; i < 16; i++) {
+        sprintf(key, "b%d", i);
+        hm_put(&hm, key, (uintptr_t)i);
+    }
+    /* 32 keys from group 0: 16 fit at home, the rest would have to go past
+     * group 1 to group 2, two groups out. Robin Hood lets them push group 1's
+     * keys on instead, so nobody ends up more than one group from home. */
+    for (int i = 0; i < 32; i++) {
+        sprintf(key, "a%d", i);
+        hm_put(&hm, key, (uintptr_t)i);
+    }
+    assert(hm.max_probe == 1);
+
+    for (uintptr_t i = 0; i < 32; i++) {
+        sprintf(key, "a%lu", i);
+        assert(hm_get(&hm, key) == i);
+        if (i < 16) {
+            sprintf(key, "b%lu", i);
+            assert(hm_get(&hm, key) == i);
+        }
+    }
+    assert(hm_contains_key(&hm, "a99") == 0);
+    assert(hm_contains_key(&hm, "b99") == 0);
+
+    hm_destroy(&hm);
+}
+
+/* tombstones only where a probe went past, and reused by the next put */
+static void test_tombstone_accounting(void) {
+    hashmap hm = { .hasher = constant_hash };
+    char key[32];
+
+    /* 40 keys with one home: two full groups and 8 in the third */
+    for (int i = 0; i < 40; i++) {
+        sprintf(key, "k%d", i);
+        hm_put(&hm, key, (uintptr_t)i);
+    }
+
+    assert(hm_remove(&hm, "k0") == 1);     // full group, probes pass it
+    assert(hm.tombstones == 1);
+    assert(hm_remove(&hm, "k39") == 1);    // last group has room, no tombstone
+    assert(hm.tombstones == 1);
+
+    for (uintptr_t i = 1; i < 39; i++) {
+        sprintf(key, "k%lu", i);
+        assert(hm_get(&hm, key) == i);
+    }
+
+    assert(hm_put(&hm, "new", 1) == 0);    // takes the tombstone
+    assert(hm.tombstones == 0);
+    assert(hm.count == 39);
+
+    hm_destroy(&hm);
+}
+
+/* seed is picked on first use, and a fixed seed is kept */
+static void test_seed(void) {
+    hashmap a = (hashmap){0}, b = (hashmap){0};
+    hm_put(&a, "x", 1);
+    hm_put(&b, "x", 1);
+    assert(a.seed != 0 && b.seed != 0 && a.seed != b.seed);
+
+    hashmap c = { .seed = 42 };
+    hm_put(&c, "x", 1);
+    assert(c.seed == 42);
+
+    assert(hm_hash_wyhash("abc", 3, 1) != hm_hash_wyhash("abc", 3, 2));
+    assert(hm_hash_wyhash("abc", 3, 1) == hm_hash_wyhash("abc", 3, 1));
+
+    hm_destroy(&a);
+    hm_destroy(&b);
+    hm_destroy(&c);
+}
+
+/* binary keys by length, and precomputed hashes shared between maps */
+static void test_len_and_hashed(void) {
+    hashmap hm = (hashmap){0};
+    const char buf[] = "abc\0def\0abc\0def";   // NULs inside the keys
+
+    assert(hm_put_n(&hm, buf, 7, 1) == 0);          // "abc\0def"
+    assert(hm_put_n(&hm, buf, 3, 2) == 0);          // "abc"
+    assert(hm_put_n(&hm, buf, 15, 3) == 0);         // long, goes to arena
+    assert(hm.count == 3);
+
+    assert(hm_get_n(&hm, buf + 8, 7) == 1);         // same bytes, other copy
+    assert(hm_get(&hm, "abc") == 2);
+    assert(hm_contains_key_n(&hm, buf + 8, 4) == 0);
+    assert(hm_get_n(&hm, buf, 15) == 3);
+    assert(hm_remove_n(&hm, buf, 7) == 1);
+    assert(hm_contains_key_n(&hm, buf, 7) == 0);
+
+    hashmap other = { .seed = hm.seed };
+    size_t h = hm_hash(&hm, "shared", 6);
+    assert(h == hm_hash(&other, "shared", 6));
+    assert(hm_put_hashed(&hm, "shared", 6, h, 10) == 0);
+    assert(hm_put_hashed(&other, "shared", 6, h, 20) == 0);
+    assert(hm_get_hashed(&hm, "shared", 6, h) == 10);
+    assert(hm_get_hashed(&other, "shared", 6, h) == 20);
+    assert(hm_get(&other, "shared") == 20);
+    assert(hm_contains_key_hashed(&hm, "shared", 6, h) == 1);
+    assert(hm_remove_hashed(&other, "shared", 6, h) == 1);
+    assert(hm_contains_key(&other, "shared") == 0);
+
+    hm_destroy(&hm);
+    hm_destroy(&other);
+}
+
+/* incremental resize: everything stays reachable while two tables exist */
+static void test_incremental_resize(void) {
+    hashmap hm = { .flags = HM_INCREMENTAL };
+    char key[32];
+    const int N = 20000;
+    int saw_migration = 0;
+
+    for (int i = 0; i < N; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i) == 0);
+        saw_migration |= hm.old_items != NULL;
+
+        /* poke at older keys while they may still be in the old table */
+        sprintf(key, "k%d", i / 2);
+        assert(hm_get(&hm, key) == (uintptr_t)(i / 2));
+        if (i % 5 == 0) {
+            sprintf(key, "k%d", i / 3);
+            assert(hm_put(&hm, key, (uintptr_t)(i / 3)) == 1);
+        }
+    }
+    assert(saw_migration);
+    assert(hm.count == (size_t)N);
+
+    for (int i = 0; i < N; i += 2) {
+        sprintf(key, "k%d", i);
+        assert(hm_remove(&hm, key) == 1);
+    }
+    for (uintptr_t i = 0; i < (uintptr_t)N; i++) {
+        sprintf(key, "k%lu", i);
+        assert(hm_contains_key(&hm, key) == (int)(i & 1));
+        assert(hm_get(&hm, key) == (i & 1 ? i : 0));
+    }
+    assert(hm.count == (size_t)N / 2);
+    assert(hm_contains_value(&hm, (uintptr_t)N - 1) == 1);
+
+    hm_destroy(&hm);
+}
+
+/* removed keys are reused, and compaction gives the rest back */
+static void test_arena_reuse_and_compact(void) {
+    /* sized up front, so the removes below don't shrink (and compact) it */
+    hashmap hm;
+    assert(hm_init_ex(&hm, &(hm_config){ .capacity = 1 << 14 }) == 0);
+    char key[64];
+
+    /* churn through long keys: the same few blocks get reused */
+    for (int i = 0; i < 100000; i++) {
+        sprintf(key, "a-key-too-long-to-be-inline-%06d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i) == 0);
+        assert(hm_remove(&hm, key) == 1);
+    }
+    assert(hm_compact(&hm) <= 4096);
+
+    /* fill, drop most, compact: survivors move and still resolve */
+    for (int i = 0; i < 10000; i++) {
+        sprintf(key, "another-long-key-number-%d", i);
+        hm_put(&hm, key, (uintptr_t)i);
+    }
+    for (int i = 0; i < 10000; i++) {
+        if (i % 10 == 0) continue;
+        sprintf(key, "another-long-key-number-%d", i);
+        assert(hm_remove(&hm, key) == 1);
+    }
+    assert(hm_compact(&hm) > 100000);
+    for (uintptr_t i = 0; i < 10000; i++) {
+        sprintf(key, "another-long-key-number-%lu", i);
+        assert(hm_get(&hm, key) == (i % 10 == 0 ? i : 0));
+    }
+    assert(hm_put(&hm, "one-more-long-key-after-compact", 7) == 0);
+    assert(hm_get(&hm, "one-more-long-key-after-compact") == 7);
+
+    hm_destroy(&hm);
+}
+
+/* configured map: capacity and load factor as asked, no resize needed */
+static void test_init_ex(void) {
+    hashmap hm;
+    char key[32];
+
+    hm_config bad = { .max_load = 1.5f };
+    assert(hm_init_ex(&hm, &bad) == -1);
+
+    hm_config cfg = { .capacity = 100000, .max_load = 0.5f, .arena_chunk = 1 << 16 };
+    assert(hm_init_ex(&hm, &cfg) == 0);
+    assert(hm.capacity == 131072);
+    assert(hm.arena != NULL);
+
+    hm_entry *items = hm.items;
+    for (int i = 0; i < 65536; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i) == 0);
+    }
+    assert(hm.items == items);              // up to half full: same table
+    assert(hm_put(&hm, "one-too-many", 1) == 0);
+    assert(hm.capacity == 262144);          // past half: doubled
+
+    hm_destroy(&hm);
+}
+
+/* reserve up front, then a bulk load never resizes */
+static void test_reserve(void) {
+    hashmap hm = (hashmap){0};
+    char key[32];
+
+    assert(hm_reserve(&hm, 100000) == 0);
+    hm_entry *items = hm.items;
+    size_t cap = hm.capacity;
+    assert(cap * 7 / 8 > 100000);
+
+    for (int i = 0; i < 100000; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i) == 0);
+    }
+    assert(hm.items == items && hm.capacity == cap);
+    assert(hm_reserve(&hm, 10) == 0);       // never shrinks
+    assert(hm.capacity == cap);
+    hm_destroy(&hm);
+
+    /* and removes before the load don't shrink the reservation away */
+    hm = (hashmap){0};
+    assert(hm_reserve(&hm, 100000) == 0);
+    cap = hm.capacity;
+    size_t resizes = hm.resizes;
+    assert(hm_put(&hm, "a", 1) == 0 && hm_put(&hm, "b", 2) == 0);
+    assert(hm_remove(&hm, "a") == 1 && hm.capacity == cap);
+    for (int i = 0; i < 100000; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i) == 0);
+    }
+    assert(hm.capacity == cap && hm.resizes == resizes);
+    hm_destroy(&hm);
+
+    /* a small reserve gets the same 512 slot floor removes shrink to */
+    hm = (hashmap){0};
+    assert(hm_reserve(&hm, 10) == 0 && hm.capacity == 512);
+    hm_destroy(&hm);
+}
+
+/* batches agree with the one-at-a-time calls */
+static void test_batches(void) {
+    hashmap hm = (hashmap){0};
+    enum { N = 1000 };
+    static char bufs[N][48];
+    const char *keys[N];
+    size_t lens[N];
+    uintptr_t vals[N], got[N];
+
+    for (int i = 0; i < N; i++) {
+        /* every third key is long enough to live in the arena */
+        lens[i] = (size_t)sprintf(bufs[i], i % 3 ? "k%d" : "a-long-batch-key-%d", i);
+        keys[i] = bufs[i];
+        vals[i] = (uintptr_t)i + 1;
+    }
+
+    assert(hm_put_many(&hm, keys, NULL, vals, N / 2) == N / 2);
+    assert(hm_put_many(&hm, keys, lens, vals, N) == N - N / 2);
+    assert(hm.count == N);
+
+    assert(hm_get_many(&hm, keys, lens, got, N) == N);
+    for (int i = 0; i < N; i++)
+        assert(got[i] == vals[i] && hm_get(&hm, keys[i]) == vals[i]);
+
+    assert(hm_remove_many(&hm, keys, NULL, N / 2) == N / 2);
+    assert(hm_get_many(&hm, keys, NULL, got, N) == N - N / 2);
+    for (int i = 0; i < N; i++)
+        assert(got[i] == (i < N / 2 ? 0 : vals[i]));
+
+    hm_destroy(&hm);
+}
+
+/* sharded map behaves like one map */
+static void test_sharded(void) {
+    hm_sharded s;
+    char key[32];
+
+    assert(hm_sharded_init(&s, (1u << 31) + 1, NULL) == -1);
+    assert(hm_sharded_init(&s, 10, NULL) == 0);
+    assert(s.nshards == 16);
+
+    for (int i = 0; i < 5000; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_sharded_put(&s, key, (uintptr_t)i + 1) == 0);
+    }
+    assert(hm_sharded_put(&s, "k1", 42) == 1);
+    assert(hm_sharded_count(&s) == 5000);
+
+    for (uintptr_t i = 0; i < 5000; i++) {
+        sprintf(key, "k%lu", i);
+        assert(hm_sharded_get(&s, key) == (i == 1 ? 42 : i + 1));
+    }
+    assert(hm_sharded_remove(&s, "k7") == 1);
+    assert(hm_sharded_remove(&s, "k7") == 0);
+    assert(hm_sharded_contains_key(&s, "k7") == 0);
+    assert(hm_sharded_contains_key_n(&s, "k8xyz", 2) == 1);
+
+    hm_sharded_destroy(&s);
+    assert(s.shards == NULL);
+}
+
+/* HM_CONCURRENT, one thread: same answers as a plain map through grows,
+ * removes, tombstone rebuilds and compaction (the threads are in heavy_test) */
+static void test_concurrent(void) {
+    hashmap hm;
+    char key[64];
+
+    assert(hm_init_ex(&hm, &(hm_config){ .flags = HM_CONCURRENT | HM_INCREMENTAL }) == -1);
+    assert(hm_init_ex(&hm, &(hm_config){ .flags = HM_CONCURRENT }) == 0);
+    assert(hm.sync != NULL);
+
+    for (int i = 0; i < 5000; i++) {
+        sprintf(key, i % 2 ? "k%d" : "a rather long key, number %d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i + 1) == 0);
+    }
+    assert(hm_put(&hm, "k1", 42) == 1);
+    assert(hm_get(&hm, "k1") == 42);
+
+    /* removed slots are not reused until a rebuild clears them */
+    for (int i = 0; i < 5000; i += 3) {
+        sprintf(key, i % 2 ? "k%d" : "a rather long key, number %d", i);
+        assert(hm_remove(&hm, key) == 1);
+    }
+    assert(hm.tombstones == 1667);
+    assert(hm_compact(&hm) > 0);
+
+    for (uintptr_t i = 0; i < 5000; i++) {
+        sprintf(key, i % 2 ? "k%lu" : "a rather long key, number %lu", i);
+        uintptr_t want = i % 3 == 0 ? 0 : i == 1 ? 42 : i + 1;
+        assert(hm_get(&hm, key) == want);
+        assert(hm_contains_key(&hm, key) == (want != 0));
+    }
+    assert(hm_contains_value(&hm, 42) == 1);
+    assert(hm_contains_value(&hm, 4) == 0);
+
+    const char *keys[] = { "k1", "k3", "nope" };
+    uintptr_t vals[3];
+    assert(hm_get_many(&hm, keys, NULL, vals, 3) == 1);
+    assert(vals[0] == 42 && vals[1] == 0 && vals[2] == 0);
+    hm_destroy(&hm);
+
+    /* from the initializer, set up by the first put */
+    hashmap lazy = { .flags = HM_CONCURRENT };
+    assert(hm_get(&lazy, "x") == 0);
+    assert(hm_put(&lazy, "x", 1) == 0);
+    assert(lazy.sync != NULL && hm_get(&lazy, "x") == 1);
+    hm_destroy(&lazy);
+}
+
+/* HM_VALUE_INDEX counts keys per value, and agrees with a scan of a plain
+ * map through puts, overwrites and removes */
+static void test_value_index(void) {
+    hashmap hm = { .flags = HM_VALUE_INDEX };
+    hashmap plain = {0};
+    char key[32];
+
+    assert(hm_contains_value(&hm, 0) == 0);
+    hm_put(&hm, "a", 7);
+    hm_put(&hm, "b", 7);
+    assert(hm_remove(&hm, "a") == 1);
+    assert(hm_contains_value(&hm, 7) == 1);
+    hm_put(&hm, "b", 8);
+    assert(hm_contains_value(&hm, 7) == 0);
+    assert(hm_contains_value(&hm, 8) == 1);
+    hm_remove(&hm, "b");
+    assert(hm_contains_value(&hm, 8) == 0);
+
+    srand(7);
+    for (int op = 0; op < 100000; op++) {
+        sprintf(key, "k%d", rand() % 5000);
+        uintptr_t v = (uintptr_t)(rand() % 3000);
+        if (rand() % 3) {
+            assert(hm_put(&hm, key, v) == hm_put(&plain, key, v));
+        } else {
+            assert(hm_remove(&hm, key) == hm_remove(&plain, key));
+        }
+        if (op % 97 == 0) {
+            v = (uintptr_t)(rand() % 3000);
+            assert(hm_contains_value(&hm, v) == hm_contains_value(&plain, v));
+        }
+    }
+    for (uintptr_t v = 0; v < 3000; v++)
+        assert(hm_contains_value(&hm, v) == hm_contains_value(&plain, v));
+
+    hm_destroy(&hm);
+    hm_destroy(&plain);
+    assert(hm.value_index == NULL && plain.value_index == NULL);
+}
+
+/* hm_save / hm_open_mmap round trip: same answers from the mapping, which
+ * is read-only, and files that aren't snapshots are turned away */
+static void test_snapshot(void) {
+    const char *path = "test_snapshot.hm";
+    hashmap hm = { .hasher = hm_hash_fnv1a };
+    char key[64];
+
+    for (int i = 0; i < 3000; i++) {
+        sprintf(key, i % 2 ? "k%d" : "a rather long key, number %d", i);
+        hm_put(&hm, key, (uintptr_t)i + 1);
+    }
+    for (int i = 0; i < 3000; i += 5) {
+        sprintf(key, i % 2 ? "k%d" : "a rather long key, number %d", i);
+        hm_remove(&hm, key);
+    }
+    assert(hm_save(&hm, path) == 0);
+
+    hashmap snap;
+    assert(hm_open_mmap(&snap, path) == 0);
+    assert(snap.count == hm.count && snap.capacity == hm.capacity);
+    assert(snap.hasher == hm_hash_fnv1a && snap.seed == hm.seed);
+    for (uintptr_t i = 0; i < 3000; i++) {
+        sprintf(key, i % 2 ? "k%lu" : "a rather long key, number %lu", i);
+        uintptr_t want = i % 5 == 0 ? 0 : i + 1;
+        assert(hm_get(&snap, key) == want);
+        assert(hm_contains_key(&snap, key) == (want != 0));
+    }
+    assert(hm_get(&snap, "a rather long key, but not in there") == 0);
+    assert(hm_contains_value(&snap, 2) == 1);
+    assert(hm_put(&snap, "new", 1) == -1);
+    assert(hm_remove(&snap, "k1") == 0 && hm_get(&snap, "k1") == 2);
+
+    /* a mapped map saves like any other */
+    assert(hm_save(&snap, path) == 0);
+    hm_destroy(&snap);
+    assert(hm_open_mmap(&snap, path) == 0);
+    assert(hm_get(&snap, "a rather long key, number 2") == 3);
+    hm_destroy(&snap);
+
+    FILE *f = fopen(path, "r+b");
+    assert(f && fputc('X', f) == 'X' && fclose(f) == 0);
+    assert(hm_open_mmap(&snap, path) == -1);
+    assert(hm_open_mmap(&snap, "no/such/file") == -1);
+    remove(path);
+
+    hashmap custom = { .hasher = constant_hash };
+    hm_put(&custom, "a", 1);
+    assert(hm_save(&custom, path) == -1);
+    hm_destroy(&custom);
+    hm_destroy(&hm);
+}
+
+/* hm_freeze: every key in its one slot, misses rejected by the compare,
+ * iteration sees each key once */
+static void test_freeze(void) {
+    hashmap hm = {0};
+    hm_frozen f;
+    char key[64];
+    const int N = 10000;
+
+    assert(hm_freeze(&f, &hm) == 0);
+    assert(f.count == 0 && hm_frozen_get(&f, "x") == 0);
+    hm_frozen_destroy(&f);
+
+    for (int i = 0; i < N; i++) {
+        sprintf(key, i % 2 ? "k%d" : "a rather long key, number %d", i);
+        hm_put(&hm, key, (uintptr_t)i + 1);
+    }
+    for (int i = 0; i < N; i += 7) {
+        sprintf(key, i % 2 ? "k%d" : "a rather long key, number %d", i);
+        hm_remove(&hm, key);
+    }
+    assert(hm_freeze(&f, &hm) == 0);
+    assert(f.count == hm.count);
+    assert(f.nbuckets < f.count / 3);
+
+    for (uintptr_t i = 0; i < (uintptr_t)N + 100; i++) {
+        sprintf(key, i % 2 ? "k%lu" : "a rather long key, number %lu", i);
+        uintptr_t want = i % 7 == 0 || i >= (uintptr_t)N ? 0 : i + 1;
+        assert(hm_frozen_get(&f, key) == want);
+        assert(hm_frozen_contains_key_n(&f, key, strlen(key)) == (want != 0));
+    }
+
+    char *seen = calloc(N, 1);
+    const char *k;
+    size_t len, n = 0;
+    uintptr_t v;
+    for (size_t it = 0; hm_frozen_next(&f, &it, &k, &len, &v); n++) {
+        assert(strlen(k) == len && hm_get(&hm, k) == v);
+        assert(!seen[v - 1]);
+        seen[v - 1] = 1;
+    }
+    assert(n == hm.count);
+    free(seen);
+
+    /* the frozen map stands on its own */
+    hm_destroy(&hm);
+    assert(hm_frozen_get(&f, "a rather long key, number 2") == 3);
+    hm_frozen_destroy(&f);
+
+    /* keys that always hash the same can't be told apart by slot */
+    hashmap same = { .hasher = constant_hash };
+    hm_put(&same, "a", 1);
+    hm_put(&same, "b", 2);
+    assert(hm_freeze(&f, &same) == -1);
+    hm_destroy(&same);
+}
+
+/* hm_u64 against a plain array over a small key range, plus the keys that
+ * are special to it: 0 and the extremes */
+static void test_u64(void) {
+    hm_u64 m = {0};
+    enum { RANGE = 4096 };
+    uintptr_t *ref = calloc(RANGE, sizeof *ref);
+
+    assert(hm_u64_get(&m, 5) == 0 && hm_u64_remove(&m, 5) == 0);
+    assert(hm_u64_put(&m, 0, 7) == 0 && hm_u64_put(&m, 0, 8) == 1);
+    assert(hm_u64_get(&m, 0) == 8 && hm_u64_contains_key(&m, 0));
+    assert(hm_u64_put(&m, UINT64_MAX, 9) == 0 && hm_u64_get(&m, UINT64_MAX) == 9);
+    assert(m.count == 2);
+    assert(hm_u64_remove(&m, 0) == 1 && hm_u64_remove(&m, 0) == 0);
+    assert(!hm_u64_contains_key(&m, 0) && m.count == 1);
+
+    srand(11);
+    for (int op = 0; op < 200000; op++) {
+        uint64_t k = 1 + (uint64_t)(rand() % (RANGE - 1));
+        uintptr_t v = (uintptr_t)rand() + 1;
+        if (rand() % 3) {
+            assert(hm_u64_put(&m, k, v) == (ref[k] != 0));
+            ref[k] = v;
+        } else {
+            assert(hm_u64_remove(&m, k) == (ref[k] != 0));
+            ref[k] = 0;
+        }
+    }
+    size_t n = 1;   // UINT64_MAX
+    for (uint64_t k = 1; k < RANGE; k++) {
+        assert(hm_u64_get(&m, k) == ref[k]);
+        assert(hm_u64_contains_key(&m, k) == (ref[k] != 0));
+        n += ref[k] != 0;
+    }
+    assert(m.count == n);
+
+    /* grows past its load, and reserve gets there in one step */
+    for (uint64_t k = 1; k <= 100000; k++)
+        hm_u64_put(&m, k << 20, k);
+    for (uint64_t k = 1; k <= 100000; k++)
+        assert(hm_u64_get(&m, k << 20) == k);
+    assert(m.count * 4 <= m.capacity * 3);
+    hm_u64_destroy(&m);
+    assert(m.items == NULL && m.count == 0);
+
+    assert(hm_u64_reserve(&m, 100000) == 0);
+    size_t cap = m.capacity;
+    for (uint64_t k = 1; k <= 100000; k++)
+        hm_u64_put(&m, k, k);
+    assert(m.capacity == cap);
+    hm_u64_destroy(&m);
+    free(ref);
+}
+
 /* remove twice = OK */
 static void test_double_remove(void) {
     hashmap hm = (hashmap){0};
@@ -177,7 +817,675 @@ static void test_arena_usage(void) {
     hm_destroy(&hm);
 }
 
-int main(void) {
+/* A counting bump allocator: hands out one big block front to back and
+ * never reuses anything, counts what is live by the sizes it is told, and
+ * checks that whatever it is asked to free came from it. */
+typedef struct {
+    char *base;
+    size_t size, used;
+    size_t allocs, frees, live;
+    size_t max_allocs;  // fail every one after this many, 0 = no limit
+} bump;
+
+static void *bump_alloc(void *ctx, size_t size) {
+    bump *b = ctx;
+    size_t rounded = (size + 15) & ~(size_t)15;
+    if (b->used + rounded > b->size || (b->max_allocs && b->allocs == b->max_allocs))
+        return NULL;
+    void *p = b->base + b->used;
+    b->used += rounded;
+    b->allocs++;
+    b->live += size;
+    return p;
+}
+
+static void bump_free(void *ctx, void *p, size_t size) {
+    bump *b = ctx;
+    assert((char *)p >= b->base && (char *)p < b->base + b->used);
+    assert(b->live >= size);
+    b->frees++;
+    b->live -= size;
+}
+
+static void *bump_realloc(void *ctx, void *p, size_t old_size, size_t size) {
+    void *q = bump_alloc(ctx, size);
+    if (q && p) {
+        memcpy(q, p, old_size < size ? old_size : size);
+        bump_free(ctx, p, old_size);
+    }
+    return q;
+}
+
+/* a map given its own allocator uses it, and gives everything back */
+static void test_allocator(void) {
+    bump b = { .base = malloc(1 << 24), .size = 1 << 24 };
+    hm_allocator a = { bump_alloc, bump_realloc, bump_free, &b };
+    char key[64];
+
+    hashmap hm = { .allocator = &a, .flags = HM_VALUE_INDEX };
+    for (int i = 0; i < 20000; i++) {
+        sprintf(key, i % 2 ? "k%d" : "a rather long key, number %d", i);
+        hm_put(&hm, key, (uintptr_t)i);
+    }
+    assert(b.allocs > 10 && b.live > 20000 * sizeof(hm_entry));
+    hm_compact(&hm);
+    hm_frozen f;
+    assert(hm_freeze(&f, &hm) == 0);
+    hm_destroy(&hm);
+    hm_frozen_destroy(&f);
+    assert(b.live == 0 && b.frees == b.allocs);
+
+    /* out of memory comes back as -1, not a crash */
+    b.used = b.size;
+    hashmap full = { .allocator = &a };
+    assert(hm_put(&full, "x", 1) == -1);
+    hm_destroy(&full);
+
+    /* or in the middle of growing: the table fills up to its last free
+     * slot, and then puts fail instead of probing forever */
+    unsigned flags[] = { 0, HM_INCREMENTAL, HM_CONCURRENT, HM_ORDERED };
+    for (int f = 0; f < 4; f++) {
+        b = (bump){ .base = b.base, .size = 1 << 24 };
+        hashmap m = { .allocator = &a, .flags = flags[f] };
+        assert(hm_put(&m, "k0", 1) == 0);
+        b.max_allocs = b.allocs;
+        int i = 1, r;
+        do {
+            sprintf(key, "k%d", i);
+            r = hm_put(&m, key, (uintptr_t)i + 1);
+        } while (r == 0 && ++i < 100000);
+        assert(r == -1 && m.capacity == 512 && m.count == (size_t)i);
+        for (int j = 0; j < i; j++) {
+            sprintf(key, "k%d", j);
+            assert(hm_get(&m, key) == (uintptr_t)j + 1);
+        }
+        assert(hm_remove(&m, "k0") == 1);
+        b.max_allocs = 0;
+        assert(hm_put(&m, "k0", 7) == 0 && hm_get(&m, "k0") == 7);
+        hm_destroy(&m);
+        assert(b.live == 0);
+    }
+    free(b.base);
+}
+
+/* hm_stats sees what a bad hash does to a map */
+static void test_stats(void) {
+    hashmap hm = { .hasher = constant_hash };
+    hm_statistics st;
+    char key[64];
+
+    hm_stats(&hm, &st);
+    assert(st.count == 0 && st.capacity == 0 && st.longest_cluster == 0);
+
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, i % 2 ? "k%d" : "a key too long to be inline %d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i + 1) == 0);
+    }
+    hm_stats(&hm, &st);
+    assert(st.count == 100 && st.max_probe == 6);
+    for (int i = 0; i < 6; i++)     // one home: 6 full groups, then 4 keys
+        assert(st.hit_probes[i] == 16);
+    assert(st.hit_probes[6] == 4);
+    assert(st.longest_cluster == 6);
+    size_t groups = 0, hits = 0;
+    for (int i = 0; i < HM_STATS_BUCKETS; i++) {
+        hits += st.hit_probes[i];
+        groups += st.miss_probes[i];
+    }
+    assert(hits == 100 && groups == st.capacity / 16);
+    for (int i = 1; i < 7; i++)     // a miss from inside the cluster
+        assert(st.miss_probes[i] == 1);
+    assert(st.avg_hit_probes > 3.63 && st.avg_hit_probes < 3.65);
+    assert(st.arena_bytes == st.arena_live + st.arena_free + st.arena_wasted);
+    assert(st.arena_live == 50 * 32);
+
+    assert(hm_remove(&hm, "a key too long to be inline 0") == 1);
+    hm_stats(&hm, &st);
+    assert(st.tombstones == 1 && st.count == 99);
+    assert(st.arena_free == 32 && st.arena_live == 49 * 32);
+    assert(st.load > 0.0 && st.load < 1.0);
+
+    /* a good hash, grown a few times */
+    hashmap good = { 0 };
+    for (int i = 0; i < 10000; i++) {
+        sprintf(key, "k%d", i);
+        hm_put(&good, key, (uintptr_t)i + 1);
+    }
+    hm_stats(&good, &st);
+    assert(st.resizes >= 4 && st.resize_ns > 0);
+    assert(st.avg_hit_probes < 1.5 && st.longest_cluster < 8);
+
+#ifdef HM_STATS_COUNTERS
+    good.counters = (hm_counters){ 0 };
+    for (int i = 0; i < 10000; i++) {
+        sprintf(key, "k%d", i * 2);
+        hm_get(&good, key);
+    }
+    hm_stats(&good, &st);
+    assert(st.counters.gets == 10000 && st.counters.get_hits == 5000);
+    assert(st.counters.finds == 10000 && st.counters.groups >= 10000);
+    hm_put(&good, "k0", 7);
+    hm_put(&good, "new", 7);
+    hm_stats(&good, &st);
+    assert(st.counters.overwrites == 1 && st.counters.inserts == 1);
+
+    /* the lock-free readers of a concurrent map count the same */
+    hashmap cc;
+    assert(hm_init_ex(&cc, &(hm_config){ .flags = HM_CONCURRENT }) == 0);
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_put(&cc, key, (uintptr_t)i + 1) == 0);
+    }
+    cc.counters = (hm_counters){ 0 };
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "k%d", i * 2);
+        hm_get(&cc, key);
+    }
+    hm_stats(&cc, &st);
+    assert(st.counters.gets == 1000 && st.counters.get_hits == 500);
+    assert(st.counters.finds == 1000 && st.counters.groups >= 1000);
+    hm_destroy(&cc);
+#endif
+
+    hm_destroy(&good);
+    hm_destroy(&hm);
+}
+
+/* value slots: found or inserted in one go, and a stored 0 isn't a miss */
+static void test_upsert(void) {
+    hashmap hm = { 0 };
+    char key[64];
+    int inserted;
+
+    assert(hm_get_ptr(&hm, "nothing") == NULL);
+    uintptr_t *v = hm_upsert(&hm, "zero", &inserted);
+    assert(v && *v == 0 && inserted == 1);
+    assert(hm_get_ptr(&hm, "zero") && *hm_get_ptr(&hm, "zero") == 0);
+    assert(hm_get_ptr(&hm, "one") == NULL);
+
+    /* counting words, through several resizes and Robin Hood moves */
+    for (int rep = 0; rep < 3; rep++)
+        for (int i = 0; i < 5000; i++) {
+            sprintf(key, i % 3 ? "w%d" : "a longer word that goes to the arena %d", i);
+            v = hm_upsert(&hm, key, &inserted);
+            assert(v && inserted == (rep == 0));
+            (*v)++;
+        }
+    assert(hm.count == 5001);
+    for (int i = 0; i < 5000; i++) {
+        sprintf(key, i % 3 ? "w%d" : "a longer word that goes to the arena %d", i);
+        assert(hm_get(&hm, key) == 3);
+    }
+    *hm_get_ptr(&hm, "w1") = 42;
+    assert(hm_get(&hm, "w1") == 42);
+    assert(hm_put(&hm, "w1", 7) == 1 && *hm_get_ptr(&hm, "w1") == 7);
+    hm_destroy(&hm);
+
+    /* same in the middle of incremental resizes */
+    hashmap inc = { .flags = HM_INCREMENTAL };
+    for (int rep = 0; rep < 2; rep++)
+        for (int i = 0; i < 20000; i++) {
+            sprintf(key, "k%d", i);
+            (*hm_upsert(&inc, key, NULL)) += (uintptr_t)i;
+        }
+    for (int i = 0; i < 20000; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_get(&inc, key) == (uintptr_t)i * 2);
+    }
+    hm_destroy(&inc);
+
+    /* maps that watch their values don't hand out slots */
+    hashmap vi = { .flags = HM_VALUE_INDEX };
+    hm_put(&vi, "a", 1);
+    assert(hm_upsert(&vi, "a", &inserted) == NULL && inserted == 0);
+    assert(hm_get_ptr(&vi, "a") == NULL);
+    hm_destroy(&vi);
+}
+
+/* hm_next sees every key once, plain and mid incremental resize */
+static void test_iterate(void) {
+    unsigned flags[] = { 0, HM_INCREMENTAL };
+    char key[64];
+    for (int f = 0; f < 2; f++) {
+        hashmap hm = { .flags = flags[f] };
+        /* the incremental map stops with a resize half done */
+        int keys = 0;
+        while (keys < 3000 || (f && !hm.old_items)) {
+            sprintf(key, keys % 2 ? "k%d" : "a key that is long enough %d", keys);
+            hm_put(&hm, key, (uintptr_t)++keys);
+        }
+
+        char *seen = calloc((size_t)keys, 1);
+        const char *k;
+        size_t len, n = 0;
+        uintptr_t v;
+        for (size_t it = 0; hm_next(&hm, &it, &k, &len, &v); n++) {
+            assert(v >= 1 && v <= (uintptr_t)keys && !seen[v - 1]);
+            seen[v - 1] = 1;
+            /* a get would move entries of the incremental map under us */
+            assert(strlen(k) == len && (f || hm_get_n(&hm, k, len) == v));
+        }
+        assert(n == (size_t)keys);
+        free(seen);
+        hm_destroy(&hm);
+    }
+
+    hashmap empty = { 0 };
+    size_t it = 0;
+    assert(hm_next(&empty, &it, NULL, NULL, NULL) == 0);
+}
+
+/* HM_ORDERED keeps insertion order through overwrites, removes and resizes */
+static void test_ordered(void) {
+    hashmap hm;
+    assert(hm_init_ex(&hm, &(hm_config){ .flags = HM_ORDERED | HM_INCREMENTAL }) == -1);
+    assert(hm_init_ex(&hm, &(hm_config){ .flags = HM_ORDERED | HM_CONCURRENT }) == -1);
+    assert(hm_init_ex(&hm, &(hm_config){ .flags = HM_ORDERED }) == 0);
+    char key[64];
+
+    for (int i = 0; i < 10000; i++) {
+        sprintf(key, i % 3 ? "k%d" : "a key that is long enough %d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i) == 0);
+    }
+    assert(hm_put(&hm, "k1", 1) == 1);          // stays where it is
+    for (int i = 0; i < 10000; i += 2) {        // every even one goes...
+        sprintf(key, i % 3 ? "k%d" : "a key that is long enough %d", i);
+        assert(hm_remove(&hm, key) == 1);
+    }
+    for (int i = 0; i < 10000; i += 4) {        // ...half of them come back last
+        sprintf(key, i % 3 ? "k%d" : "a key that is long enough %d", i);
+        assert(hm_put(&hm, key, (uintptr_t)i) == 0);
+    }
+    assert(hm.count == 7500);
+
+    const char *k;
+    size_t len, n = 0;
+    uintptr_t v, last = 0;
+    for (size_t it = 0; hm_next(&hm, &it, &k, &len, &v); n++) {
+        if (n < 5000) {
+            assert(v == 2 * n + 1 && (n == 0 || v > last));
+        } else {
+            assert(v == 4 * (n - 5000));
+        }
+        assert(hm_get_n(&hm, k, len) == v);
+        last = v;
+    }
+    assert(n == 7500);
+
+    /* churn: holes get squeezed out instead of piling up */
+    for (int round = 0; round < 20; round++)
+        for (int i = 0; i < 5000; i++) {
+            sprintf(key, "churn%d", i);
+            if (round % 2) assert(hm_remove(&hm, key) == 1);
+            else assert(hm_put(&hm, key, 1) == 0);
+        }
+    assert(hm.count == 7500 && hm.used <= 2 * 7500 + 5000);
+    assert(hm_get(&hm, "k1") == 1 && hm_contains_key(&hm, "k0") == 0);
+
+    /* the rest of the API on top */
+    uintptr_t *p = hm_upsert(&hm, "new", NULL);
+    assert(p && *p == 0);
+    *p = 99;
+    assert(hm_get(&hm, "new") == 99 && *hm_get_ptr(&hm, "new") == 99);
+    hm_statistics st;
+    hm_stats(&hm, &st);
+    assert(st.count == 7501 && st.hit_probes[0] > 7000);
+    assert(st.table_bytes == hm.capacity * 5 + hm.entries_cap * sizeof(hm_entry));
+    hm_frozen f;
+    assert(hm_freeze(&f, &hm) == 0);
+    assert(hm_frozen_get(&f, "new") == 99 && hm_frozen_get(&f, "k1") == 1);
+    hm_frozen_destroy(&f);
+    hm_compact(&hm);
+    assert(hm_get(&hm, "k9998") == 0);
+    assert(hm_get(&hm, "a key that is long enough 9999") == 9999);
+    assert(hm_get(&hm, "a key that is long enough 9996") == 9996);
+    hm_destroy(&hm);
+
+    hashmap lazy = { .flags = HM_ORDERED | HM_VALUE_INDEX };
+    assert(hm_reserve(&lazy, 1000) == 0 && lazy.entries_cap >= 1000);
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "%d", i);
+        hm_put(&lazy, key, (uintptr_t)i % 10);
+    }
+    assert(hm_contains_value(&lazy, 9) && !hm_contains_value(&lazy, 10));
+    size_t it = 0;
+    assert(hm_next(&lazy, &it, &k, &len, &v) && strcmp(k, "0") == 0);
+    assert(hm_next(&lazy, &it, &k, &len, &v) && strcmp(k, "1") == 0 && v == 1);
+    hm_destroy(&lazy);
+}
+
+/* maps shrink after a burst, with hysteresis, and hm_clear keeps memory */
+static void test_shrink_and_clear(void) {
+    hashmap hm = { 0 };
+    hm_statistics st;
+    char key[64];
+
+    for (int i = 0; i < 100000; i++) {
+        sprintf(key, "a burst of long keys, number %d", i);
+        hm_put(&hm, key, (uintptr_t)i + 1);
+    }
+    size_t peak = hm.capacity;
+    hm_stats(&hm, &st);
+    size_t peak_arena = st.arena_bytes;
+    for (int i = 1000; i < 100000; i++) {
+        sprintf(key, "a burst of long keys, number %d", i);
+        assert(hm_remove(&hm, key) == 1);
+    }
+    hm_stats(&hm, &st);
+    assert(hm.capacity <= peak / 16 && st.arena_bytes < peak_arena / 8);
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "a burst of long keys, number %d", i);
+        assert(hm_get(&hm, key) == (uintptr_t)i + 1);
+    }
+
+    /* going up and down by half: one shrink the first time, then no more */
+    size_t resizes = 0;
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 500; i++) {
+            sprintf(key, "a burst of long keys, number %d", i);
+            if (round % 2) hm_put(&hm, key, (uintptr_t)i + 1);
+            else hm_remove(&hm, key);
+        }
+        if (round == 0) resizes = hm.resizes;
+    }
+    assert(hm.resizes == resizes);
+
+    assert(hm_shrink_to_fit(&hm) == 0);
+    assert(hm.tombstones == 0 && hm.capacity == 2048);  // 1024 holds 896
+    assert(hm_get(&hm, "a burst of long keys, number 999") == 1000);
+    hm_destroy(&hm);
+
+    /* never below the capacity asked for */
+    hashmap sized;
+    assert(hm_init_ex(&sized, &(hm_config){ .capacity = 1 << 16 }) == 0);
+    for (int i = 0; i < 50000; i++) {
+        sprintf(key, "k%d", i);
+        hm_put(&sized, key, 1);
+    }
+    for (int i = 0; i < 50000; i++) {
+        sprintf(key, "k%d", i);
+        hm_remove(&sized, key);
+    }
+    assert(sized.capacity == 1 << 16);
+    hm_destroy(&sized);
+
+    /* a burst put in batches shrinks away the same: sizing for a batch
+     * isn't a reservation */
+    hashmap batched = { 0 };
+    enum { BURST = 50000, BATCH = 1000 };
+    static char bufs[BATCH][32];
+    const char *keys[BATCH];
+    uintptr_t values[BATCH] = { 0 };
+    for (int b0 = 0; b0 < BURST; b0 += BATCH) {
+        for (int i = 0; i < BATCH; i++) {
+            sprintf(bufs[i], "k%d", b0 + i);
+            keys[i] = bufs[i];
+        }
+        assert(hm_put_many(&batched, keys, NULL, values, BATCH) == BATCH);
+    }
+    peak = batched.capacity;
+    for (int i = 0; i < BURST; i++) {
+        sprintf(key, "k%d", i);
+        assert(hm_remove(&batched, key) == 1);
+    }
+    assert(peak >= 65536 && batched.capacity == 512);
+    hm_destroy(&batched);
+
+    /* clear and refill: no new memory the second time */
+    bump b = { .base = malloc(1 << 26), .size = 1 << 26 };    // never reuses, so roomy
+    hm_allocator a = { bump_alloc, bump_realloc, bump_free, &b };
+    unsigned flags[] = { 0, HM_ORDERED | HM_VALUE_INDEX, HM_INCREMENTAL, HM_CONCURRENT };
+    for (int f = 0; f < 4; f++) {
+        hashmap m = { .allocator = &a, .flags = flags[f] };
+        size_t allocs = 0, cap = 0;
+        for (int round = 0; round < 3; round++) {
+            int n = 0;
+            /* the incremental map is cleared with a resize half done */
+            while (n < 20000 || (flags[f] == HM_INCREMENTAL && !m.old_items)) {
+                if (n % 2) sprintf(key, "k%d", n);
+                else sprintf(key, "round %d, a long key %d", round, n);
+                assert(hm_put(&m, key, (uintptr_t)n + 1) == 0);
+                n++;
+            }
+            assert(hm_get(&m, "k1") == 2);
+            if (round == 2 && flags[f] != HM_INCREMENTAL && flags[f] != HM_CONCURRENT)
+                assert(b.allocs == allocs && m.capacity == cap);
+            allocs = b.allocs;
+            cap = m.capacity;
+            assert(hm_clear(&m) == 0);
+            assert(m.count == 0 && hm_get(&m, "k1") == 0 && hm_contains_value(&m, 2) == 0);
+            size_t it = 0;
+            assert(hm_next(&m, &it, NULL, NULL, NULL) == 0);
+        }
+        hm_destroy(&m);
+    }
+    assert(b.live == 0);
+    free(b.base);
+}
+
+/* hm_build gives the same map as hm_put of each pair in order, whatever the
+ * number of threads, with duplicates and with keys crowding one partition */
+static uint64_t crowded_hash(const void *key, size_t len, uint64_t seed) {
+    /* every home is in the first two groups */
+    return hm_hash_wyhash(key, len, seed) & 0xffffffff00000fffull;
+}
+
+static void test_build(void) {
+    enum { N = 60000 };
+    static char buf[N][48];
+    static const char *keys[N];
+    static size_t lens[N];
+    static uintptr_t values[N];
+    for (int i = 0; i < N; i++) {
+        /* every 10th key again, later and with another value */
+        int k = i % 10 == 9 ? i / 3 : i;
+        if (k % 2) lens[i] = (size_t)sprintf(buf[i], "b%d", k);
+        else lens[i] = (size_t)sprintf(buf[i], "a long key to go in the arena, %d", k);
+        keys[i] = buf[i];
+        values[i] = (uintptr_t)i + 1;
+    }
+
+    hashmap ref = { .seed = 7 };
+    for (int i = 0; i < N; i++)
+        hm_put_n(&ref, keys[i], lens[i], values[i]);
+
+    unsigned threads[] = { 1, 3, 8, 0 };
+    for (int t = 0; t < 4; t++) {
+        hashmap hm;
+        assert(hm_build(&hm, &(hm_config){ .seed = 7, .max_load = 0.95f }, keys, lens,
+                        values, N, threads[t]) == 0);
+        assert(hm.count == ref.count);
+        for (int i = 0; i < N; i++)
+            assert(hm_get_n(&hm, keys[i], lens[i]) == hm_get_n(&ref, keys[i], lens[i]));
+        assert(hm_get(&hm, "nope") == 0);
+
+        hm_statistics st;
+        hm_stats(&hm, &st);
+        assert(st.count == ref.count && st.resizes == 0 && st.tombstones == 0);
+        assert(st.arena_live > 0 && st.arena_live <= st.arena_bytes);
+
+        /* and from here on it is a map like any other */
+        assert(hm_put(&hm, "nope", 5) == 0 && hm_put(&hm, "b5", 5) == 1);
+        assert(hm_remove_n(&hm, keys[0], lens[0]) == 1);
+        assert(hm_get(&hm, "b5") == 5 && hm_get_n(&hm, keys[0], lens[0]) == 0);
+        for (int i = 0; i < N; i++)
+            hm_remove_n(&hm, keys[i], lens[i]);
+        assert(hm.count == 1 && hm_get(&hm, "nope") == 5);
+        hm_destroy(&hm);
+    }
+    hm_destroy(&ref);
+
+    /* one partition takes every key, most of them spill */
+    hashmap crowded, cref = { .hasher = crowded_hash, .seed = 7 };
+    assert(hm_build(&crowded, &(hm_config){ .hasher = crowded_hash, .seed = 7 },
+                    keys, lens, values, 3000, 2) == 0);
+    for (int i = 0; i < 3000; i++)
+        hm_put_n(&cref, keys[i], lens[i], values[i]);
+    assert(crowded.count == cref.count);
+    for (int i = 0; i < 3000; i++)
+        assert(hm_get_n(&crowded, keys[i], lens[i]) == hm_get_n(&cref, keys[i], lens[i]));
+    hm_destroy(&crowded);
+    hm_destroy(&cref);
+
+    /* flags: the value index is filled in, a concurrent map is published */
+    hashmap vi, cm, om;
+    assert(hm_build(&vi, &(hm_config){ .flags = HM_VALUE_INDEX }, keys, NULL, values, N, 4) == 0);
+    assert(hm_contains_value(&vi, 10) == 1 && hm_contains_value(&vi, 4) == 0);
+    assert(hm_contains_value(&vi, N) == 1);
+    hm_destroy(&vi);
+    assert(hm_build(&cm, &(hm_config){ .flags = HM_CONCURRENT }, keys, lens, values, N, 4) == 0);
+    assert(hm_get_n(&cm, keys[N - 1], lens[N - 1]) == N && hm_put(&cm, "nope", 1) == 0);
+    hm_destroy(&cm);
+    assert(hm_build(&om, &(hm_config){ .flags = HM_ORDERED }, keys, lens, values, N, 4) == -1);
+
+    hashmap empty;
+    assert(hm_build(&empty, NULL, keys, lens, values, 0, 4) == 0);
+    assert(empty.count == 0 && hm_put(&empty, "a", 1) == 0 && hm_get(&empty, "a") == 1);
+    hm_destroy(&empty);
+}
+
+/* resize_threads: the same map as a resize on one thread, also when homes
+ * bunch up so runs cross the partitions, and for same-size rebuilds */
+static uint64_t bunched_hash(const void *key, size_t len, uint64_t seed) {
+    /* homes only in the last 512 slots of every 8192, so the runs of full
+     * groups go on well past the end of a partition */
+    return hm_hash_wyhash(key, len, seed) | (uint64_t)0xf << 16;
+}
+
+static void test_parallel_resize(void) {
+    char key[64];
+    hm_hash_fn hashers[] = { NULL, bunched_hash };
+    int counts[] = { 200000, 40000 };      // bunched keys are slow to put
+    for (int h = 0; h < 2; h++) {
+        int n = counts[h];
+        hashmap hm, ref = { .hasher = hashers[h], .seed = 3 };
+        assert(hm_init_ex(&hm, &(hm_config){ .hasher = hashers[h], .seed = 3,
+                                             .resize_threads = 4 }) == 0);
+        for (int i = 0; i < n; i++) {
+            if (i % 3) sprintf(key, "p%d", i);
+            else sprintf(key, "a key long enough for the arena %d", i);
+            assert(hm_put(&hm, key, (uintptr_t)i + 1) == 0);
+            hm_put(&ref, key, (uintptr_t)i + 1);
+        }
+        assert(hm.count == (size_t)n && hm.capacity == ref.capacity && hm.resizes == ref.resizes);
+        for (int i = 0; i < n; i++) {
+            if (i % 3) sprintf(key, "p%d", i);
+            else sprintf(key, "a key long enough for the arena %d", i);
+            assert(hm_get(&hm, key) == (uintptr_t)i + 1);
+        }
+
+        /* a rebuild at the same size clears the tombstones */
+        size_t removed = 0;
+        for (int i = 1; i < n; i += 9) {
+            sprintf(key, "p%d", i);
+            removed += hm_remove(&hm, key);
+        }
+        size_t cap = hm.capacity;
+        assert(hm.tombstones > 0 && hm_shrink_to_fit(&hm) == 0);
+        assert(hm.capacity == cap && hm.tombstones == 0 && hm.count == n - removed);
+        assert(hm_get(&hm, "p1") == 0 && hm_get(&hm, "p2") == 3);
+        assert(hm_get(&hm, "a key long enough for the arena 0") == 1);
+        hm_destroy(&hm);
+        hm_destroy(&ref);
+    }
+
+    hashmap cm;
+    assert(hm_init_ex(&cm, &(hm_config){ .flags = HM_CONCURRENT, .resize_threads = 3 }) == 0);
+    for (int i = 0; i < 100000; i++) {
+        sprintf(key, "c%d", i);
+        hm_put(&cm, key, (uintptr_t)i + 1);
+    }
+    for (int i = 0; i < 100000; i++) {
+        sprintf(key, "c%d", i);
+        assert(hm_get(&cm, key) == (uintptr_t)i + 1);
+    }
+    hm_destroy(&cm);
+}
+
+/* interned keys: one pointer per key, kept through resizes and shrinks */
+static void test_intern(void) {
+    hashmap plain = {0};
+    assert(hm_intern(&plain, "a") == NULL);
+    hm_destroy(&plain);
+
+    unsigned flags[] = { HM_INTERN, HM_INTERN | HM_ORDERED, HM_INTERN | HM_INCREMENTAL,
+                         HM_INTERN | HM_CONCURRENT | HM_VALUE_INDEX };
+    static const char *ids[20000];
+    char key[64];
+    for (int f = 0; f < 4; f++) {
+        hashmap hm = { .flags = flags[f] };
+        for (int i = 0; i < 20000; i++) {
+            sprintf(key, i % 2 ? "id%d" : "a long identifier, number %d", i);
+            ids[i] = hm_intern(&hm, key);
+            assert(ids[i] && strcmp(ids[i], key) == 0 && hm_interned_len(ids[i]) == strlen(key));
+            assert(ids[i] != key && hm_intern(&hm, key) == ids[i]);
+        }
+        assert(hm.count == 20000 && hm_get(&hm, "id1") == 0);
+
+        /* the table grew several times, the keys stayed */
+        for (int i = 0; i < 20000; i++) {
+            sprintf(key, i % 2 ? "id%d" : "a long identifier, number %d", i);
+            assert(hm_intern(&hm, key) == ids[i]);
+            assert(hm_put_interned(&hm, ids[i], (uintptr_t)i + 1) == 1);
+        }
+        for (int i = 0; i < 20000; i++)
+            assert(hm_get_interned(&hm, ids[i]) == (uintptr_t)i + 1);
+        assert(hm_get(&hm, "id1") == 2 && hm_contains_key(&hm, "a long identifier, number 0"));
+
+        size_t it = 0, n = 0;
+        const char *k;
+        uintptr_t v;
+        while (hm_next(&hm, &it, &k, NULL, &v)) {
+            assert(k == ids[v - 1]);
+            n++;
+        }
+        assert(n == 20000);
+
+        /* removes shrink the table but don't compact the arena */
+        for (int i = 100; i < 20000; i++) {
+            sprintf(key, i % 2 ? "id%d" : "a long identifier, number %d", i);
+            assert(hm_remove(&hm, key) == 1);
+        }
+        assert(hm_shrink_to_fit(&hm) == 0 && hm_compact(&hm) == 0);
+        for (int i = 0; i < 100; i++) {
+            assert(hm_get_interned(&hm, ids[i]) == (uintptr_t)i + 1);
+            assert(hm_intern_n(&hm, ids[i], hm_interned_len(ids[i])) == ids[i]);
+        }
+        hm_statistics st;
+        hm_stats(&hm, &st);
+        assert(st.count == 100 && st.arena_live >= 100 * 16);
+        hm_destroy(&hm);
+    }
+
+    /* a frozen copy, a snapshot and a build of an interned map */
+    hashmap hm = { .flags = HM_INTERN };
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, i % 2 ? "id%d" : "a long identifier, number %d", i);
+        hm_put(&hm, key, (uintptr_t)i + 1);
+    }
+    hm_frozen fz;
+    assert(hm_freeze(&fz, &hm) == 0);
+    assert(hm_frozen_get(&fz, "id1") == 2 && hm_frozen_get(&fz, "a long identifier, number 2") == 3);
+    hm_frozen_destroy(&fz);
+
+    const char *path = "test_intern.hm";
+    hashmap snap;
+    assert(hm_save(&hm, path) == 0 && hm_open_mmap(&snap, path) == 0);
+    assert(hm_get(&snap, "id999") == 1000 && hm_get(&snap, "a long identifier, number 998") == 999);
+    hm_destroy(&snap);
+    remove(path);
+    hm_destroy(&hm);
+
+    const char *keys[] = { "x", "a long identifier, number 1", "x" };
+    uintptr_t values[] = { 1, 2, 3 };
+    hashmap built;
+    assert(hm_build(&built, &(hm_config){ .flags = HM_INTERN }, keys, NULL, values, 3, 2) == 0);
+    const char *x = hm_intern(&built, "x");
+    assert(built.count == 2 && hm_get_interned(&built, x) == 3 && hm_interned_len(x) == 1);
+    hm_destroy(&built);
+}
+
+static void run_all(void) {
     test_basic();
     test_overwrite();
     test_missing_key_nonempty();
@@ -185,9 +1493,56 @@ int main(void) {
     test_tombstone_basic();
     test_tombstone_reuse();
     test_contains_value();
+    test_contains_value_after_remove();
+    test_value_index();
+    test_key_lengths();
+    test_custom_hasher();
+    test_robin_hood();
+    test_tombstone_accounting();
+    test_seed();
+    test_len_and_hashed();
+    test_incremental_resize();
     test_double_remove();
     test_mixed_put_remove();
     test_arena_usage();
+    test_batches();
+    test_sharded();
+    test_concurrent();
+    test_init_ex();
+    test_reserve();
+    test_arena_reuse_and_compact();
+    test_snapshot();
+    test_freeze();
+    test_u64();
+    test_allocator();
+    test_stats();
+    test_upsert();
+    test_iterate();
+    test_ordered();
+    test_shrink_and_clear();
+    test_build();
+    test_parallel_resize();
+    test_intern();
+}
+
+int main(void) {
+    run_all();
+
+    /* and once more with every map on a bump allocator: if anything went
+     * around it, freeing would trip the asserts or live would not be 0 */
+    static bump b;
+    b.size = (size_t)1 << 28;
+    b.base = malloc(b.size);
+    assert(b.base);
+    hm_allocator a = { bump_alloc, bump_realloc, bump_free, &b };
+    hm_set_default_allocator(&a);
+    run_all();
+    hm_set_default_allocator(NULL);
+    printf("bump allocator: %zu allocations, %zu MiB, %zu bytes still live\n",
+           b.allocs, b.used >> 20, b.live);
+    assert(b.allocs > 0 && b.live == 0 && b.frees == b.allocs);
+    free(b.base);
+
     printf("ALL TESTS PASSED\n");
     return 0;
 }